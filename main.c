@@ -1,8 +1,30 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <float.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS
+#endif
 
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
@@ -12,87 +34,355 @@
 #define WINDOW_HEIGHT   512
 #define WINDOW_WIDTH    512
 
-static GLFWwindow* window = NULL;
-static VkInstance instance;
+#define OFFSCREEN_FORMAT    VK_FORMAT_R8G8B8A8_UNORM
+#define BATCHES_IN_FLIGHT   2
+#define MAX_FRAMES_IN_FLIGHT    2
+#define MAX_OUTPUTS         8
+
+#define SCRATCH_ARENA_SIZE      (1024 * 1024)
+#define PERSISTENT_ARENA_SIZE   (64 * 1024)
+#define ARENA_ALIGNMENT         16
+#define WARMUP_FRAMES           (MAX_FRAMES_IN_FLIGHT * 2)
+
+#define PACING_SPIN_SECONDS     0.001
+#define PACING_LATE_SECONDS     0.001
+#define IDLE_WAIT_SECONDS       0.5
+
+#define INSTANCE_LANES          8
+#define INSTANCE_ALIGNMENT      32
+#define INSTANCE_WORLD_EXTENT   2.f
+#define BENCH_INSTANCE_STEPS    (64u * 1024 * 1024)
+#define BENCH_MAX_THREADS       64
+
+#define MAX_TEXTURES            16
+#define MAX_TEXTURE_JOBS        (MAX_TEXTURES * 2)
+#define MAX_TEXTURE_SIZE        8192
+#define TEXTURE_FORMAT          VK_FORMAT_R8G8B8A8_SRGB
+#define STREAM_COARSE_SIZE      32
+#define TEXTURE_BUDGET_MB       64
+
+#define MAX_PIPELINE_VARIANTS   64
+#define MAX_PIPELINE_WORKERS    4
+
+#define NO_QUERY                UINT32_MAX
+#define OVERDRAW_BENCH_FRAMES   64
+
+#define CAPTURE_MAGIC           0x50414356u
+#define CAPTURE_VERSION         1
+#define CAPTURE_ALIGNMENT       8
+#define REPLAY_WARMUP_SECONDS   10.0
+
+enum resource_type {
+    RESOURCE_FRAMEBUFFER,
+    RESOURCE_PIPELINE,
+    RESOURCE_PIPELINE_LAYOUT,
+    RESOURCE_PIPELINE_CACHE,
+    RESOURCE_SHADER_MODULE,
+    RESOURCE_DESCRIPTOR_POOL,
+    RESOURCE_DESCRIPTOR_SET_LAYOUT,
+    RESOURCE_SAMPLER,
+    RESOURCE_QUERY_POOL,
+    RESOURCE_RENDER_PASS,
+    RESOURCE_IMAGE_VIEW,
+    RESOURCE_IMAGE,
+    RESOURCE_BUFFER,
+    RESOURCE_DEVICE_MEMORY,
+    RESOURCE_SWAP_CHAIN,
+    RESOURCE_SEMAPHORE,
+    RESOURCE_FENCE,
+    RESOURCE_COMMAND_POOL,
+    RESOURCE_TYPE_COUNT
+};
 
-static VkDevice logical_device;
-static VkQueue graphics_queue;
-static VkQueue present_queue;
+struct handle_pool {
+    uint64_t* handles;
+    uint32_t count;
+    uint32_t capacity;
+};
 
-static VkPhysicalDevice physical_device;
-static VkSurfaceKHR surface;
+struct deferred_destroy {
+    enum resource_type type;
+    uint64_t handle;
+    uint64_t serial;
+};
 
-static VkSwapchainKHR swap_chain;
-static VkImage* swap_chain_images;
-static uint32_t swap_chain_images_count;
+struct deletion_queue {
+    struct deferred_destroy* entries;
+    uint32_t count;
+    uint32_t capacity;
+};
 
-static VkImageView* swap_chain_image_views;
+struct swap_chain {
+    VkSwapchainKHR handle;
+    VkFormat format;
+    VkExtent2D extent;
 
-static VkFormat swap_chain_format;
-static VkExtent2D swap_chain_extent;
+    uint32_t images_count;
+    VkImage* images;
+    VkImageView* image_views;
+    VkFramebuffer* frame_buffers;
+    VkSemaphore* render_finished_semaphores;
+};
 
-static VkRenderPass render_pass;
-static VkPipelineLayout pipeline_layout;
-static VkPipeline pipeline;
+struct frame {
+    VkCommandBuffer command_buffer;
+    VkFence in_flight_fence;
+    uint64_t serial;
 
-static VkFramebuffer* swap_chain_frame_buffers;
+    VkDescriptorSet descriptor_set;
+    uint64_t descriptor_version;
+    uint32_t replay_frame;
+};
 
-static VkCommandPool command_pool;
-static VkCommandBuffer command_buffer;
+struct frame_pacing {
+    double interval;
+    double next_deadline;
+    double last_frame;
+    bool on_demand;
+    bool dirty;
+    bool iconified;
+
+    uint64_t frames;
+    uint64_t late_frames;
+    double sum;
+    double sum_squares;
+    double error_squares;
+    double min;
+    double max;
+};
 
-static VkSemaphore image_available_semaphore;
-static VkSemaphore render_finished_semaphore;
-static VkFence in_flight_fence;
+enum draw_order {
+    DRAW_ORDER_UNSORTED,
+    DRAW_ORDER_FRONT_TO_BACK,
+    DRAW_ORDER_BACK_TO_FRONT,
+    DRAW_ORDER_COUNT
+};
 
-static const char* device_extensions[] = {
-    VK_KHR_SWAPCHAIN_EXTENSION_NAME
+enum pipeline_blend {
+    PIPELINE_BLEND_NONE,
+    PIPELINE_BLEND_ALPHA,
+    PIPELINE_BLEND_ADDITIVE,
+    PIPELINE_BLEND_COUNT
 };
 
-void init_window() {
-    glfwInit();
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
-    glfwWindowHint(GLFW_FLOATING, GLFW_TRUE);
+// Shader features are specialization constants rather than separate SPIR-V.
+#define PIPELINE_FEATURE_TEXTURE        (1u << 0)
+#define PIPELINE_FEATURE_VERTEX_COLOR   (1u << 1)
+#define PIPELINE_FEATURES               (PIPELINE_FEATURE_TEXTURE | PIPELINE_FEATURE_VERTEX_COLOR)
+
+// The cull modes and topologies a pipeline can be built with.
+static const VkCullModeFlags cull_modes[3] = {VK_CULL_MODE_NONE, VK_CULL_MODE_BACK_BIT, VK_CULL_MODE_FRONT_BIT};
+static const VkPrimitiveTopology topologies[2] = {VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP};
+
+// Everything that varies between pipelines; the rest of the state is fixed.
+struct pipeline_state {
+    VkCullModeFlags cull_mode;
+    VkPrimitiveTopology topology;
+    VkSampleCountFlagBits samples;
+    enum pipeline_blend blend;
+    uint32_t features;
+};
 
-    window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Meow :3", NULL, NULL);
-}
+enum pipeline_variant_state {
+    PIPELINE_VARIANT_EMPTY,
+    PIPELINE_VARIANT_QUEUED,
+    PIPELINE_VARIANT_COMPILING,
+    PIPELINE_VARIANT_COMPILED,
+    PIPELINE_VARIANT_READY,
+    PIPELINE_VARIANT_FAILED,
+};
 
-uint32_t clamp(uint32_t number, uint32_t min, uint32_t max) {
-    if (number < min) {
-        return min;
-    }
+struct pipeline_variant {
+    enum pipeline_variant_state state;
+    uint64_t hash;
+    struct pipeline_state key;
+    VkPipeline pipeline;
+    double compile_seconds;
+};
 
-    if (number > max) {
-        return max;
-    }
+struct pipeline_registry {
+    struct pipeline_variant variants[MAX_PIPELINE_VARIANTS];
+    uint32_t count;
+
+    pthread_t threads[MAX_PIPELINE_WORKERS];
+    uint32_t threads_count;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    uint32_t pending;
+    bool paused;
+    bool stop;
+
+    uint64_t compiled;
+    double compile_seconds;
+    uint64_t fallback_binds;
+};
 
-    return number;
-}
+struct instance_store {
+    float* x;
+    float* y;
+    float* velocity_x;
+    float* velocity_y;
+    float* scale;
+    float* depth;
+    uint32_t* color;
+    uint32_t* texture;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t texture_first[MAX_TEXTURES + 1];
+
+    uint64_t* sort_keys[2];
+    uint32_t* sort_values[2];
+    float* spare_float;
+    uint32_t* spare_uint;
+    bool order_dirty;
+    uint32_t sort_passes;
+};
 
-char* read_file(char* path, uint32_t* size) {
-    FILE* file = fopen(path, "r");
-    fseek(file, 0, SEEK_END);
-    *size = ftell(file);
-    rewind(file);
+struct gpu_instance {
+    float position[3];
+    float size[2];
+    uint32_t color;
+};
 
-    while ((*size % 32) != 0) {
-        (*size)++;
-    }
+struct instance_view {
+    float scale_x;
+    float scale_y;
+};
 
-    char* ret = malloc(*size * sizeof(char));
-    fread(ret, sizeof(char), *size, file);
+struct instance_draws {
+    uint32_t first[MAX_TEXTURES];
+    uint32_t count[MAX_TEXTURES];
+};
 
-    return ret;
-}
+typedef void (*update_kernel)(struct instance_store* store, uint32_t begin, uint32_t end, float dt);
+typedef uint32_t (*cull_kernel)(const struct instance_store* store, uint32_t begin, uint32_t end, struct instance_view view, struct gpu_instance* out);
 
-struct optional_uint32_t {
-    uint32_t value;
-    bool assigned;
+struct instance_kernels {
+    const char* name;
+    update_kernel update;
+    cull_kernel cull;
 };
 
-struct queue_family_indices {
-    struct optional_uint32_t graphics_family;
-    struct optional_uint32_t present_family;
+enum texture_state {
+    TEXTURE_EMPTY,
+    TEXTURE_LOADING_COARSE,
+    TEXTURE_COARSE,
+    TEXTURE_LOADING_FULL,
+    TEXTURE_FULL,
+    TEXTURE_FAILED,
+};
+
+enum texture_job_state {
+    TEXTURE_JOB_FREE,
+    TEXTURE_JOB_QUEUED,
+    TEXTURE_JOB_LOADING,
+    TEXTURE_JOB_UPLOADED,
+    TEXTURE_JOB_IN_FLIGHT,
+    TEXTURE_JOB_RETIRED,
+};
+
+struct texture_image {
+    VkImage image;
+    VkDeviceMemory memory;
+    VkImageView view;
+    VkDeviceSize size;
+};
+
+struct texture {
+    const char* path;
+    enum texture_state state;
+    uint32_t width;
+    uint32_t height;
+    bool coarse_is_full;
+    struct texture_image coarse;
+    struct texture_image full;
+    uint64_t last_used;
+
+    const uint8_t* captured;
+    uint32_t captured_width;
+    uint32_t captured_height;
+};
+
+struct texture_job {
+    enum texture_job_state state;
+    uint32_t texture;
+    bool full;
+
+    bool failed;
+    uint32_t source_width;
+    uint32_t source_height;
+    uint32_t width;
+    uint32_t height;
+    uint32_t levels;
+    struct texture_image image;
+    VkBuffer staging;
+    VkDeviceMemory staging_memory;
+    VkCommandBuffer command_buffer;
+    VkSemaphore uploaded;
+    bool submitted;
+    uint64_t serial;
+};
+
+struct texture_uploads {
+    struct texture_job* jobs[MAX_TEXTURE_JOBS];
+    uint32_t count;
+};
+
+struct texture_streaming {
+    struct texture textures[MAX_TEXTURES];
+    uint32_t textures_count;
+    struct texture_job jobs[MAX_TEXTURE_JOBS];
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;
+    bool stop;
+
+    VkCommandPool command_pool;
+    VkSampler sampler;
+    VkFilter blit_filter;
+    VkDeviceSize budget;
+    VkDeviceSize resident;
+    uint64_t version;
+    uint64_t evictions;
+    uint64_t busy_frames;
+};
+
+struct offscreen_target {
+    VkImage image;
+    VkDeviceMemory memory;
+    VkImageView image_view;
+    VkFramebuffer frame_buffer;
+};
+
+enum allocation_source {
+    ALLOCATION_SOURCE_APPLICATION,
+    ALLOCATION_SOURCE_VULKAN,
+    ALLOCATION_SOURCE_VULKAN_INTERNAL,
+    ALLOCATION_SOURCE_COUNT
+};
+
+struct allocation_stats {
+    size_t current;
+    size_t peak;
+    size_t total;
+    uint64_t allocations;
+    uint64_t frees;
+};
+
+struct allocation_header {
+    void* block;
+    size_t size;
+    enum allocation_source source;
+};
+
+struct arena {
+    uint8_t* base;
+    size_t capacity;
+    size_t offset;
+    size_t peak;
 };
 
 struct swap_chain_support_details {
@@ -105,800 +395,5928 @@ struct swap_chain_support_details {
     uint32_t present_modes_count;
 };
 
-struct queue_family_indices find_queue_families(VkPhysicalDevice* device) {
-    struct queue_family_indices indices;
-    uint32_t family_count = 0;
-    vkGetPhysicalDeviceQueueFamilyProperties(*device, &family_count, NULL);
+struct optional_uint32_t {
+    uint32_t value;
+    bool assigned;
+};
 
-    VkQueueFamilyProperties* families = malloc(sizeof(VkQueueFamilyProperties) * family_count);
-    vkGetPhysicalDeviceQueueFamilyProperties(*device, &family_count, families);
-    for (uint32_t i = 0; i < family_count; i++) {
-        VkQueueFamilyProperties family = families[i];
-        if (family.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-            indices.graphics_family.value = i;
-            indices.graphics_family.assigned = true;
-        }
+struct queue_family_indices {
+    struct optional_uint32_t graphics_family;
+    struct optional_uint32_t present_family;
+    struct optional_uint32_t transfer_family;
+    uint32_t graphics_queue_count;
+    uint32_t timestamp_bits;
+};
 
-        VkBool32 present_support = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(*device, i, surface, &present_support);
-        if (present_support) {
-            indices.present_family.value = i;
-            indices.present_family.assigned = true;
-        }
-        
-        if (indices.graphics_family.assigned && indices.present_family.assigned) {
-            break;
-        }
-    }
+// A window with its own surface and swap chain, or in headless runs a ring of
+// offscreen targets standing in for one. Everything else is shared.
+struct output {
+    GLFWwindow* window;
+    VkSurfaceKHR surface;
+    struct swap_chain_support_details surface_details;
+    struct swap_chain swap_chain;
+    struct texture_image depth_target;
+    struct texture_image color_target;
+    struct offscreen_target targets[MAX_FRAMES_IN_FLIGHT];
+    VkSemaphore image_available_semaphores[MAX_FRAMES_IN_FLIGHT];
+    uint32_t image_index;
+    bool resized;
+    bool iconified;
+};
 
-    free(families);
+struct render_target {
+    VkFramebuffer frame_buffer;
+    VkExtent2D extent;
+    struct instance_view view;
+};
 
-    return indices;
+// Captures are a header followed by records, each padded to CAPTURE_ALIGNMENT
+// so a mapped file can be read in place. Fields are in host byte order.
+struct capture_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t instance_size;
+    uint32_t outputs_count;
+    uint32_t textures_count;
+    uint32_t samples;
+    uint32_t cull_mode;
+    uint32_t topology;
+    uint32_t blend;
+    uint32_t features;
+    VkExtent2D extents[MAX_OUTPUTS];
+};
+
+enum capture_record_type {
+    CAPTURE_RECORD_TEXTURE = 1,
+    CAPTURE_RECORD_FRAME = 2,
+};
+
+struct capture_record {
+    uint32_t type;
+    uint32_t size;
+};
+
+// Followed by width * height RGBA8 pixels.
+struct capture_texture {
+    uint32_t texture;
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+};
+
+struct capture_target {
+    VkExtent2D extent;
+    struct instance_view view;
+};
+
+// Followed by targets_count capture_targets, then instances_count gpu_instances.
+struct capture_frame {
+    double time;
+    double cpu_seconds;
+    uint32_t instances_count;
+    uint32_t targets_count;
+    struct instance_draws draws;
+};
+
+struct capture {
+    FILE* file;
+    struct gpu_instance* instances;
+    double start;
+    uint64_t frames;
+};
+
+struct replay {
+    const uint8_t* data;
+    size_t size;
+    const struct capture_header* header;
+    const struct capture_frame** frames;
+    uint32_t frames_count;
+    uint32_t max_instances;
+
+    uint32_t current;
+    bool timing;
+    double* cpu_seconds;
+    double* gpu_seconds;
+};
+
+struct renderer_context {
+    VkInstance instance;
+
+    VkPhysicalDevice physical_device;
+    struct queue_family_indices queue_families;
+    VkDevice logical_device;
+    VkQueue graphics_queue;
+    VkQueue present_queue;
+    VkQueue transfer_queue;
+    bool transfer_queue_shared;
+
+    struct output outputs[MAX_OUTPUTS];
+    uint32_t outputs_count;
+    VkFormat color_format;
+    VkRenderPass render_pass;
+    VkFormat depth_format;
+    VkSampleCountFlagBits samples;
+    VkDescriptorSetLayout descriptor_set_layout;
+    VkDescriptorPool descriptor_pool;
+    VkPipelineCache pipeline_cache;
+    VkPipelineLayout pipeline_layout;
+    VkShaderModule vertex_shader;
+    VkShaderModule fragment_shader;
+    VkPipeline pipeline;
+    struct pipeline_state pipeline_state;
+    struct pipeline_registry pipelines;
+
+    VkCommandPool command_pool;
+    struct frame frames[MAX_FRAMES_IN_FLIGHT];
+    uint32_t current_frame;
+
+    bool reload_pipeline;
+    struct frame_pacing pacing;
+
+    struct instance_store instances;
+    enum draw_order draw_order;
+    const struct instance_kernels* kernels;
+    VkBuffer instance_buffer;
+    VkDeviceMemory instance_memory;
+    struct gpu_instance* instance_data;
+    double last_update;
+    bool animation_paused;
+    struct texture_streaming streaming;
+
+    VkQueryPool timestamp_pool;
+    VkQueryPool statistics_pool;
+    uint32_t query_slots;
+    double timestamp_period;
+    uint64_t timestamp_mask;
+    bool statistics_supported;
+
+    bool headless;
+    struct capture capture;
+    struct replay replay;
+    struct offscreen_target* offscreen_targets;
+    uint32_t offscreen_targets_count;
+
+    struct handle_pool pools[RESOURCE_TYPE_COUNT];
+    struct deletion_queue deletion_queue;
+    uint64_t frame_serial;
+    uint64_t completed_serial;
+
+    struct arena scratch;
+    struct arena persistent;
+    struct allocation_stats allocation_stats[ALLOCATION_SOURCE_COUNT];
+    pthread_t main_thread;
+    uint64_t main_thread_allocations;
+    uint64_t rebuilds;
+    uint64_t steady_state_frames;
+    uint64_t steady_state_allocations;
+    uint64_t streaming_frames;
+    uint64_t streaming_allocations;
+    uint64_t fallback_frames;
+    uint64_t fallback_allocations;
+    bool print_stats;
+};
+
+static struct renderer_context ctx;
+static pthread_mutex_t allocation_lock = PTHREAD_MUTEX_INITIALIZER;
+
+size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
 }
 
-VkResult create_logical_device() {
-    struct queue_family_indices indices = find_queue_families(&physical_device);
-    float priority = 1.f;
+void* tracked_alloc(size_t size, size_t alignment, enum allocation_source source) {
+    if (alignment < sizeof(void*)) {
+        alignment = sizeof(void*);
+    }
 
-    uint32_t unique_count = 1;
-    if (indices.graphics_family.value != indices.present_family.value) {
-        unique_count = 2;
+    size_t header_size = sizeof(struct allocation_header);
+    uint8_t* block = malloc(size + header_size + alignment);
+    if (block == NULL) {
+        return NULL;
     }
 
-    VkDeviceQueueCreateInfo queue_create_infos[2];
-    VkDeviceQueueCreateInfo graphics_queue_create_info = {
-        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-        .queueFamilyIndex = indices.graphics_family.value,
-        .queueCount = 1,
-        .pQueuePriorities = &priority,
-    };
+    uint8_t* memory = (uint8_t*)align_up((uintptr_t)(block + header_size), alignment);
+    struct allocation_header* header = (struct allocation_header*)(memory - header_size);
+    header->block = block;
+    header->size = size;
+    header->source = source;
+
+    pthread_mutex_lock(&allocation_lock);
+    struct allocation_stats* stats = &ctx.allocation_stats[source];
+    stats->current += size;
+    stats->total += size;
+    stats->allocations++;
+    if (stats->current > stats->peak) {
+        stats->peak = stats->current;
+    }
+    ctx.main_thread_allocations += pthread_equal(pthread_self(), ctx.main_thread) != 0;
+    pthread_mutex_unlock(&allocation_lock);
 
-    VkDeviceQueueCreateInfo present_queue_create_info = {
-        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-        .queueFamilyIndex = indices.present_family.value,
-        .queueCount = 1,
-        .pQueuePriorities = &priority,
-    };
+    return memory;
+}
 
-    queue_create_infos[0] = graphics_queue_create_info;
-    queue_create_infos[1] = present_queue_create_info;
+void tracked_free(void* memory) {
+    if (memory == NULL) {
+        return;
+    }
 
-    VkPhysicalDeviceFeatures features;
-    memset(&features, VK_FALSE, sizeof(VkPhysicalDeviceFeatures));
+    struct allocation_header* header = (struct allocation_header*)((uint8_t*)memory - sizeof(struct allocation_header));
+    pthread_mutex_lock(&allocation_lock);
+    struct allocation_stats* stats = &ctx.allocation_stats[header->source];
+    stats->current -= header->size;
+    stats->frees++;
+    pthread_mutex_unlock(&allocation_lock);
 
-    size_t extension_count = sizeof(device_extensions) / sizeof(char*);
-    VkDeviceCreateInfo device_create_info = {
-        .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-        .pQueueCreateInfos = queue_create_infos,
-        .queueCreateInfoCount = unique_count,
-        .pEnabledFeatures = &features,
-        .enabledLayerCount = 0,
-        .enabledExtensionCount = extension_count,
-        .ppEnabledExtensionNames = device_extensions,
-    };
+    free(header->block);
+}
 
-    VkResult out = vkCreateDevice(physical_device, &device_create_info, NULL, &logical_device);
-    if (out != VK_SUCCESS) {
-        return out;
+void* tracked_realloc(void* memory, size_t size, size_t alignment, enum allocation_source source) {
+    if (size == 0) {
+        tracked_free(memory);
+        return NULL;
     }
 
-    vkGetDeviceQueue(logical_device, indices.graphics_family.value, 0, &graphics_queue);
-    vkGetDeviceQueue(logical_device, indices.present_family.value, 0, &present_queue);
+    void* resized = tracked_alloc(size, alignment, source);
+    if (resized == NULL || memory == NULL) {
+        return resized;
+    }
 
-    return VK_SUCCESS;
+    struct allocation_header* header = (struct allocation_header*)((uint8_t*)memory - sizeof(struct allocation_header));
+    memcpy(resized, memory, header->size < size ? header->size : size);
+    tracked_free(memory);
+    return resized;
 }
 
-VkExtent2D choose_swap_chain_extent(VkSurfaceCapabilitiesKHR* capabilities) {
-    if (capabilities->currentExtent.width != UINT_MAX) {
-        return capabilities->currentExtent;
+void* host_alloc(size_t size) {
+    return tracked_alloc(size, ARENA_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+}
+
+void* host_calloc(size_t count, size_t size) {
+    void* memory = host_alloc(count * size);
+    if (memory != NULL) {
+        memset(memory, 0, count * size);
     }
 
-    int width, height;
-    glfwGetFramebufferSize(window, &width, &height);
+    return memory;
+}
 
-    VkExtent2D extent = {
-        .width = width,
-        .height = height,
-    };
+void* host_realloc(void* memory, size_t size) {
+    return tracked_realloc(memory, size, ARENA_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+}
 
-    extent.width = clamp(extent.width, capabilities->minImageExtent.width, capabilities->maxImageExtent.width);
-    extent.height = clamp(extent.height, capabilities->minImageExtent.height, capabilities->maxImageExtent.height);
-    return extent;
+void host_free(void* memory) {
+    tracked_free(memory);
 }
 
-VkPresentModeKHR choose_swap_chain_present_mode(VkPresentModeKHR* modes, uint32_t count) {
-    for (uint32_t i = 0; i < count; i++) {
-        VkPresentModeKHR mode = modes[i];
-        if (mode != VK_PRESENT_MODE_MAILBOX_KHR) {
-            continue;
-        }
+VKAPI_ATTR void* VKAPI_CALL vulkan_alloc(void* user_data, size_t size, size_t alignment, VkSystemAllocationScope scope) {
+    (void)user_data;
+    (void)scope;
+    return tracked_alloc(size, alignment, ALLOCATION_SOURCE_VULKAN);
+}
 
-        return mode;
+VKAPI_ATTR void* VKAPI_CALL vulkan_realloc(void* user_data, void* memory, size_t size, size_t alignment, VkSystemAllocationScope scope) {
+    (void)user_data;
+    (void)scope;
+    return tracked_realloc(memory, size, alignment, ALLOCATION_SOURCE_VULKAN);
+}
+
+VKAPI_ATTR void VKAPI_CALL vulkan_free(void* user_data, void* memory) {
+    (void)user_data;
+    tracked_free(memory);
+}
+
+VKAPI_ATTR void VKAPI_CALL vulkan_internal_alloc(void* user_data, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope) {
+    (void)user_data;
+    (void)type;
+    (void)scope;
+
+    pthread_mutex_lock(&allocation_lock);
+    struct allocation_stats* stats = &ctx.allocation_stats[ALLOCATION_SOURCE_VULKAN_INTERNAL];
+    stats->current += size;
+    stats->total += size;
+    stats->allocations++;
+    if (stats->current > stats->peak) {
+        stats->peak = stats->current;
     }
+    ctx.main_thread_allocations += pthread_equal(pthread_self(), ctx.main_thread) != 0;
+    pthread_mutex_unlock(&allocation_lock);
+}
 
-    return VK_PRESENT_MODE_FIFO_KHR;
+VKAPI_ATTR void VKAPI_CALL vulkan_internal_free(void* user_data, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope) {
+    (void)user_data;
+    (void)type;
+    (void)scope;
+
+    pthread_mutex_lock(&allocation_lock);
+    struct allocation_stats* stats = &ctx.allocation_stats[ALLOCATION_SOURCE_VULKAN_INTERNAL];
+    stats->current -= size;
+    stats->frees++;
+    pthread_mutex_unlock(&allocation_lock);
 }
 
-VkSurfaceFormatKHR choose_swap_chain_surface_format(VkSurfaceFormatKHR* formats, uint32_t count) {
-    for (uint32_t i = 0; i < count; i++) {
-        VkSurfaceFormatKHR format = formats[i];
-        if (format.format != VK_FORMAT_R8G8B8A8_SRGB) {
-            continue;
-        }
+static const VkAllocationCallbacks allocation_callbacks = {
+    .pfnAllocation = vulkan_alloc,
+    .pfnReallocation = vulkan_realloc,
+    .pfnFree = vulkan_free,
+    .pfnInternalAllocation = vulkan_internal_alloc,
+    .pfnInternalFree = vulkan_internal_free,
+};
 
-        if (format.colorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
-            continue;
-        }
+#define VK_ALLOCATOR (&allocation_callbacks)
 
-        return format;
-    }
+// Only the main thread's allocations are attributed to a frame: the texture
+// loader, pipeline workers and driver threads allocate whenever they run.
+uint64_t main_thread_allocation_count() {
+    pthread_mutex_lock(&allocation_lock);
+    uint64_t count = ctx.main_thread_allocations;
+    pthread_mutex_unlock(&allocation_lock);
 
-    return formats[0];
+    return count;
 }
 
-struct swap_chain_support_details query_swap_chain_details(VkPhysicalDevice* device) {
-    struct swap_chain_support_details details;
+bool arena_init(struct arena* arena, size_t capacity) {
+    arena->base = host_alloc(capacity);
+    arena->capacity = arena->base != NULL ? capacity : 0;
+    arena->offset = 0;
+    arena->peak = 0;
+    return arena->base != NULL;
+}
 
-    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(*device, surface, &details.capabilities);
+void arena_release(struct arena* arena) {
+    host_free(arena->base);
+    memset(arena, 0, sizeof(struct arena));
+}
 
-    vkGetPhysicalDeviceSurfaceFormatsKHR(*device, surface, &details.formats_count, NULL);
-    if (details.formats_count != 0) {
-        details.formats = malloc(sizeof(VkSurfaceFormatKHR) * details.formats_count);
-        vkGetPhysicalDeviceSurfaceFormatsKHR(*device, surface, &details.formats_count, details.formats);
+void* arena_push(struct arena* arena, size_t size) {
+    size_t offset = align_up(arena->offset, ARENA_ALIGNMENT);
+    if (offset + size > arena->capacity) {
+        printf("Arena exhausted: %zu of %zu bytes requested\n", offset + size, arena->capacity);
+        return NULL;
     }
 
-    vkGetPhysicalDeviceSurfacePresentModesKHR(*device, surface, &details.present_modes_count, NULL); 
-    if (details.present_modes_count != 0) {
-        details.present_modes = malloc(sizeof(VkPresentModeKHR) * details.present_modes_count);
-        vkGetPhysicalDeviceSurfacePresentModesKHR(*device, surface, &details.present_modes_count, details.present_modes);
+    arena->offset = offset + size;
+    if (arena->offset > arena->peak) {
+        arena->peak = arena->offset;
     }
 
-    return details;
+    return arena->base + offset;
 }
 
-VkResult create_swap_chain() {
-    struct swap_chain_support_details details = query_swap_chain_details(&physical_device);
+void* arena_push_zero(struct arena* arena, size_t size) {
+    void* memory = arena_push(arena, size);
+    if (memory != NULL) {
+        memset(memory, 0, size);
+    }
 
-    VkSurfaceFormatKHR surface_format = choose_swap_chain_surface_format(details.formats, details.formats_count);
-    VkPresentModeKHR present_mode = choose_swap_chain_present_mode(details.present_modes, details.present_modes_count);
-    VkExtent2D extent = choose_swap_chain_extent(&details.capabilities);
+    return memory;
+}
 
-    uint32_t image_count = details.capabilities.minImageCount + 1;
-    if (details.capabilities.maxImageCount > 0 && image_count > details.capabilities.maxImageCount) {
-        image_count = details.capabilities.maxImageCount;
-    }
+size_t arena_mark(struct arena* arena) {
+    return arena->offset;
+}
 
-    VkSwapchainCreateInfoKHR create_info = {
-        .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
-        .surface = surface,
-        .minImageCount = image_count,
-        .imageFormat = surface_format.format,
-        .imageColorSpace = surface_format.colorSpace,
-        .imageExtent = extent,
-        .imageArrayLayers = 1,
-        .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-        .preTransform = details.capabilities.currentTransform,
-        .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-        .presentMode = present_mode,
-        .clipped = VK_TRUE,
-        .oldSwapchain = VK_NULL_HANDLE
-    };
+void arena_reset(struct arena* arena, size_t mark) {
+    arena->offset = mark;
+}
 
-    struct queue_family_indices indices = find_queue_families(&physical_device);
-    uint32_t family_indices[2] = {
-        indices.graphics_family.value, 
-        indices.present_family.value
+void print_allocation_stats() {
+    static const char* names[ALLOCATION_SOURCE_COUNT] = {
+        "application",
+        "vulkan",
+        "vulkan internal",
     };
 
-    if (indices.graphics_family.value != indices.present_family.value) {
-        create_info.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
-        create_info.queueFamilyIndexCount = 2;
-        create_info.pQueueFamilyIndices = family_indices;
-    } else {
-        create_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    }
-
-    VkResult result = vkCreateSwapchainKHR(logical_device, &create_info, NULL, &swap_chain);
-    if (result != VK_SUCCESS) {
-        return result;
+    printf("%-16s %-12s %-12s %-12s %-12s %-12s\n", "host memory", "current", "peak", "total", "allocs", "frees");
+    for (uint32_t i = 0; i < ALLOCATION_SOURCE_COUNT; i++) {
+        struct allocation_stats* stats = &ctx.allocation_stats[i];
+        printf("%-16s %-12zu %-12zu %-12zu %-12llu %-12llu\n", names[i], stats->current, stats->peak, stats->total,
+            (unsigned long long)stats->allocations, (unsigned long long)stats->frees);
     }
 
-    vkGetSwapchainImagesKHR(logical_device, swap_chain, &swap_chain_images_count, NULL);
-    swap_chain_images = malloc(sizeof(VkImage) * swap_chain_images_count);
-    vkGetSwapchainImagesKHR(logical_device, swap_chain, &swap_chain_images_count, swap_chain_images);
+    printf("scratch arena peak: %zu of %zu bytes\n", ctx.scratch.peak, ctx.scratch.capacity);
+    printf("persistent arena peak: %zu of %zu bytes\n", ctx.persistent.peak, ctx.persistent.capacity);
+    printf("steady state frames: %llu, heap allocations in them: %llu\n",
+        (unsigned long long)ctx.steady_state_frames, (unsigned long long)ctx.steady_state_allocations);
+    printf("texture streaming frames: %llu, heap allocations in them: %llu\n",
+        (unsigned long long)ctx.streaming_frames, (unsigned long long)ctx.streaming_allocations);
+    printf("pipeline fallback frames: %llu, heap allocations in them: %llu\n",
+        (unsigned long long)ctx.fallback_frames, (unsigned long long)ctx.fallback_allocations);
+}
 
-    swap_chain_format = surface_format.format;
-    swap_chain_extent = extent;
+double now_seconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
 
-    return result;
+double cpu_seconds() {
+    struct timespec time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
 }
 
-VkResult create_image_view() {
-    swap_chain_image_views = malloc(sizeof(VkImageView) * swap_chain_images_count);
-    for (uint32_t i = 0; i < swap_chain_images_count; i++) {
-        VkImageViewCreateInfo create_info = {
-            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-            .image = swap_chain_images[i],
-            .viewType = VK_IMAGE_VIEW_TYPE_2D,
-            .format = swap_chain_format,
-            .components.r = VK_COMPONENT_SWIZZLE_IDENTITY,
-            .components.g = VK_COMPONENT_SWIZZLE_IDENTITY,
-            .components.b = VK_COMPONENT_SWIZZLE_IDENTITY,
-            .components.a = VK_COMPONENT_SWIZZLE_IDENTITY,
-            .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .subresourceRange.baseMipLevel = 0,
-            .subresourceRange.levelCount = 1,
-            .subresourceRange.baseArrayLayer = 0,
-            .subresourceRange.layerCount = 1
-        };
-        VkResult result = vkCreateImageView(logical_device, &create_info, NULL, &swap_chain_image_views[i]);
-        if (result != VK_SUCCESS) {
-            return result;
-        }
+void instance_store_assign_textures(struct instance_store* store, uint32_t first_texture, uint32_t texture_count) {
+    for (uint32_t i = 0; i < store->count; i++) {
+        store->texture[i] = first_texture + (uint32_t)((uint64_t)i * texture_count / store->count);
     }
 
-    return VK_SUCCESS;
+    store->order_dirty = true;
 }
 
-VkResult create_render_pass() {
-    VkAttachmentDescription color_attachment = {
-        .format = swap_chain_format,
-        .samples = VK_SAMPLE_COUNT_1_BIT,
-        .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
-        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-    };
+bool instance_store_init(struct instance_store* store, uint32_t count) {
+    memset(store, 0, sizeof(struct instance_store));
+    store->count = count;
+    store->capacity = (uint32_t)align_up(count, INSTANCE_LANES);
+
+    size_t size = sizeof(float) * store->capacity;
+    store->x = tracked_alloc(size, INSTANCE_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+    store->y = tracked_alloc(size, INSTANCE_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+    store->velocity_x = tracked_alloc(size, INSTANCE_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+    store->velocity_y = tracked_alloc(size, INSTANCE_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+    store->scale = tracked_alloc(size, INSTANCE_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+    store->depth = tracked_alloc(size, INSTANCE_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+    store->color = tracked_alloc(sizeof(uint32_t) * store->capacity, INSTANCE_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+    store->texture = tracked_alloc(sizeof(uint32_t) * store->capacity, INSTANCE_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+    if (store->x == NULL || store->y == NULL || store->velocity_x == NULL || store->velocity_y == NULL ||
+        store->scale == NULL || store->depth == NULL || store->color == NULL || store->texture == NULL) {
+        return false;
+    }
 
-    VkAttachmentReference attachment_reference = {
-        .attachment = 0,
-        .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-    };
+    // Sort scratch lives with the store so reordering never allocates once running.
+    for (uint32_t i = 0; i < 2; i++) {
+        store->sort_keys[i] = tracked_alloc(sizeof(uint64_t) * store->capacity, INSTANCE_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+        store->sort_values[i] = tracked_alloc(sizeof(uint32_t) * store->capacity, INSTANCE_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+        if (store->sort_keys[i] == NULL || store->sort_values[i] == NULL) {
+            return false;
+        }
+    }
 
-    VkSubpassDescription subpass = {
-        .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
-        .pColorAttachments = &attachment_reference,
-        .colorAttachmentCount = 1,
-    };
+    store->spare_float = tracked_alloc(size, INSTANCE_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+    store->spare_uint = tracked_alloc(sizeof(uint32_t) * store->capacity, INSTANCE_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+    if (store->spare_float == NULL || store->spare_uint == NULL) {
+        return false;
+    }
 
-    VkSubpassDependency dependancy = {
-        .srcSubpass = VK_SUBPASS_EXTERNAL,
-        .dstSubpass = 0,
-        .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-        .srcAccessMask = 0,
-    };
+    memset(store->x, 0, size);
+    memset(store->y, 0, size);
+    memset(store->velocity_x, 0, size);
+    memset(store->velocity_y, 0, size);
+    memset(store->scale, 0, size);
+    memset(store->depth, 0, size);
+    memset(store->color, 0, sizeof(uint32_t) * store->capacity);
+    instance_store_assign_textures(store, 0, 1);
+    return true;
+}
 
-    VkRenderPassCreateInfo render_pass_info = {
-        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-        .pAttachments = &color_attachment,
-        .attachmentCount = 1,
-        .pSubpasses = &subpass,
-        .subpassCount = 1,
-        .pDependencies = &dependancy,
-        .dependencyCount = 1,
-    };
+void instance_store_release(struct instance_store* store) {
+    host_free(store->x);
+    host_free(store->y);
+    host_free(store->velocity_x);
+    host_free(store->velocity_y);
+    host_free(store->scale);
+    host_free(store->depth);
+    host_free(store->color);
+    host_free(store->texture);
+    for (uint32_t i = 0; i < 2; i++) {
+        host_free(store->sort_keys[i]);
+        host_free(store->sort_values[i]);
+    }
+    host_free(store->spare_float);
+    host_free(store->spare_uint);
+    memset(store, 0, sizeof(struct instance_store));
+}
 
-    return vkCreateRenderPass(logical_device, &render_pass_info, NULL, &render_pass);
+float random_float(uint32_t* state, float min, float max) {
+    *state = *state * 1664525u + 1013904223u;
+    return min + (max - min) * (float)(*state >> 8) / (float)(1u << 24);
 }
 
-VkShaderModule create_shader_module(char* binary, uint32_t size) {
-    VkShaderModuleCreateInfo create_info = {
-        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-        .pCode = (uint32_t*)binary,
-        .codeSize = size 
-    };
+void instance_store_seed(struct instance_store* store, uint32_t seed) {
+    store->order_dirty = true;
+    if (store->count == 1) {
+        store->scale[0] = 1.f;
+        store->depth[0] = 0.5f;
+        store->color[0] = 0xffffffffu;
+        return;
+    }
 
-    VkShaderModule shader_module;
-    vkCreateShaderModule(logical_device, &create_info, NULL, &shader_module);
-    return shader_module;
+    uint32_t state = seed;
+    for (uint32_t i = 0; i < store->count; i++) {
+        store->x[i] = random_float(&state, -INSTANCE_WORLD_EXTENT, INSTANCE_WORLD_EXTENT);
+        store->y[i] = random_float(&state, -INSTANCE_WORLD_EXTENT, INSTANCE_WORLD_EXTENT);
+        store->velocity_x[i] = random_float(&state, -0.5f, 0.5f);
+        store->velocity_y[i] = random_float(&state, -0.5f, 0.5f);
+        store->scale[i] = random_float(&state, 0.02f, 0.1f);
+        store->depth[i] = random_float(&state, 0.f, 1.f);
+        state = state * 1664525u + 1013904223u;
+        store->color[i] = state | 0xff000000u;
+    }
 }
 
-VkResult create_graphics_pipeline() {
-    uint32_t vertex_shader_size;
-    uint32_t fragment_shader_size;
+// Keys order by pipeline, then texture (the descriptor index), then depth.
+// Depth sits in [0, 1], so its IEEE bits already compare like the float.
+uint64_t draw_sort_key(uint32_t pipeline, uint32_t texture, float depth, enum draw_order order) {
+    uint32_t bits = 0;
+    if (order != DRAW_ORDER_UNSORTED) {
+        memcpy(&bits, &depth, sizeof(bits));
+        if (order == DRAW_ORDER_BACK_TO_FRONT) {
+            bits = ~bits;
+        }
+    }
 
-    char* vertex_shader_code = read_file("./shaders/vert.spv", &vertex_shader_size);
-    char* fragment_shader_code = read_file("./shaders/frag.spv", &fragment_shader_size);
+    return (uint64_t)(pipeline & 0xff) << 56 | (uint64_t)(texture & 0xff) << 48 | (uint64_t)bits << 16;
+}
 
-    VkShaderModule vertex_shader = create_shader_module(vertex_shader_code, vertex_shader_size);
-    VkShaderModule fragment_shader = create_shader_module(fragment_shader_code, fragment_shader_size);
+// LSD radix sort on 8-bit digits. Digits every key shares are skipped, so the
+// unused low bits and a lone pipeline cost nothing. The sorted run ends up in
+// keys[0] / values[0]; returns the number of scatter passes made.
+uint32_t radix_sort(uint64_t* keys[2], uint32_t* values[2], uint32_t count) {
+    uint32_t histogram[8][256];
+    memset(histogram, 0, sizeof(histogram));
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t key = keys[0][i];
+        for (uint32_t digit = 0; digit < 8; digit++) {
+            histogram[digit][(key >> (digit * 8)) & 0xff]++;
+        }
+    }
 
-    VkPipelineShaderStageCreateInfo vertex_shader_create_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        .stage = VK_SHADER_STAGE_VERTEX_BIT,
-        .module = vertex_shader,
-        .pName = "main"
-    };
+    uint32_t passes = 0;
+    for (uint32_t digit = 0; digit < 8; digit++) {
+        uint32_t* counts = histogram[digit];
+        if (counts[(keys[0][0] >> (digit * 8)) & 0xff] == count) {
+            continue;
+        }
 
-    VkPipelineShaderStageCreateInfo fragment_shader_create_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
-        .module = fragment_shader,
-        .pName = "main"
-    };
+        uint32_t offset = 0;
+        for (uint32_t bucket = 0; bucket < 256; bucket++) {
+            uint32_t bucket_count = counts[bucket];
+            counts[bucket] = offset;
+            offset += bucket_count;
+        }
 
-    VkPipelineShaderStageCreateInfo shader_stages[2] = {
-        vertex_shader_create_info,
-        fragment_shader_create_info
-    };
+        for (uint32_t i = 0; i < count; i++) {
+            uint64_t key = keys[0][i];
+            uint32_t target = counts[(key >> (digit * 8)) & 0xff]++;
+            keys[1][target] = key;
+            values[1][target] = values[0][i];
+        }
 
-    VkPipelineVertexInputStateCreateInfo vertex_input_create_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-        .vertexBindingDescriptionCount = 0,
-        .vertexAttributeDescriptionCount = 0,
-    };
+        uint64_t* swap_keys = keys[0];
+        keys[0] = keys[1];
+        keys[1] = swap_keys;
+        uint32_t* swap_values = values[0];
+        values[0] = values[1];
+        values[1] = swap_values;
+        passes++;
+    }
 
-    VkPipelineInputAssemblyStateCreateInfo input_assembly_create_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-        .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
-        .primitiveRestartEnable = VK_FALSE,
-    };
+    return passes;
+}
 
-    VkPipelineViewportStateCreateInfo viewport_state_create_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
-        .viewportCount = 1,
-        .scissorCount = 1,
-    };
+void gather_float(float** array, float** spare, const uint32_t* order, uint32_t count) {
+    float* source = *array;
+    float* target = *spare;
+    for (uint32_t i = 0; i < count; i++) {
+        target[i] = source[order[i]];
+    }
 
-    VkPipelineRasterizationStateCreateInfo rasterizer_create_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
-        .depthBiasClamp = VK_FALSE,
-        .rasterizerDiscardEnable = VK_FALSE,
-        .polygonMode = VK_POLYGON_MODE_FILL,
-        .lineWidth = 1.f,
-        .cullMode = VK_CULL_MODE_BACK_BIT,
-        .frontFace = VK_FRONT_FACE_CLOCKWISE,
-        .depthBiasEnable = VK_FALSE,
-    };
+    *array = target;
+    *spare = source;
+}
 
-    VkPipelineMultisampleStateCreateInfo multisampling_create_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
-        .sampleShadingEnable = VK_FALSE,
-        .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
-    };
+void gather_uint(uint32_t** array, uint32_t** spare, const uint32_t* order, uint32_t count) {
+    uint32_t* source = *array;
+    uint32_t* target = *spare;
+    for (uint32_t i = 0; i < count; i++) {
+        target[i] = source[order[i]];
+    }
 
-    VkPipelineColorBlendAttachmentState color_blend_attachment = {
-        .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
-        .blendEnable = VK_FALSE,
-    };
+    *array = target;
+    *spare = source;
+}
 
-    VkPipelineColorBlendStateCreateInfo color_blend_create_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
-        .logicOpEnable = VK_FALSE,
-        .logicOp = VK_LOGIC_OP_COPY,
-        .attachmentCount = 1,
-        .pAttachments = &color_blend_attachment,
+// Reorders the store itself rather than an index list, so the cull kernels keep
+// streaming through contiguous arrays and write sorted instances straight into
+// the mapped buffer. Only needs redoing when textures or depths change.
+void instance_store_sort(struct instance_store* store, enum draw_order order) {
+    store->order_dirty = false;
+    store->sort_passes = 0;
+    if (store->count > 1) {
+        for (uint32_t i = 0; i < store->count; i++) {
+            // Untextured and textured groups draw with different pipeline variants.
+            store->sort_keys[0][i] = draw_sort_key(store->texture[i] != 0, store->texture[i], store->depth[i], order);
+            store->sort_values[0][i] = i;
+        }
+
+        store->sort_passes = radix_sort(store->sort_keys, store->sort_values, store->count);
+        if (store->sort_passes > 0) {
+            const uint32_t* permutation = store->sort_values[0];
+            gather_float(&store->x, &store->spare_float, permutation, store->count);
+            gather_float(&store->y, &store->spare_float, permutation, store->count);
+            gather_float(&store->velocity_x, &store->spare_float, permutation, store->count);
+            gather_float(&store->velocity_y, &store->spare_float, permutation, store->count);
+            gather_float(&store->scale, &store->spare_float, permutation, store->count);
+            gather_float(&store->depth, &store->spare_float, permutation, store->count);
+            gather_uint(&store->color, &store->spare_uint, permutation, store->count);
+            gather_uint(&store->texture, &store->spare_uint, permutation, store->count);
+        }
+    }
+
+    uint32_t i = 0;
+    for (uint32_t t = 0; t < MAX_TEXTURES; t++) {
+        while (i < store->count && store->texture[i] < t) {
+            i++;
+        }
+        store->texture_first[t] = i;
+    }
+
+    store->texture_first[MAX_TEXTURES] = store->count;
+}
+
+uint32_t count_draw_groups(const struct instance_store* store) {
+    uint32_t groups = 0;
+    for (uint32_t t = 0; t < MAX_TEXTURES; t++) {
+        groups += store->texture_first[t + 1] > store->texture_first[t];
+    }
+
+    return groups;
+}
+
+void update_instances_scalar(struct instance_store* store, uint32_t begin, uint32_t end, float dt) {
+    for (uint32_t i = begin; i < end; i++) {
+        float x = store->x[i] + store->velocity_x[i] * dt;
+        if (x < -INSTANCE_WORLD_EXTENT || x > INSTANCE_WORLD_EXTENT) {
+            store->velocity_x[i] = -store->velocity_x[i];
+            x = x < -INSTANCE_WORLD_EXTENT ? -INSTANCE_WORLD_EXTENT : INSTANCE_WORLD_EXTENT;
+        }
+
+        float y = store->y[i] + store->velocity_y[i] * dt;
+        if (y < -INSTANCE_WORLD_EXTENT || y > INSTANCE_WORLD_EXTENT) {
+            store->velocity_y[i] = -store->velocity_y[i];
+            y = y < -INSTANCE_WORLD_EXTENT ? -INSTANCE_WORLD_EXTENT : INSTANCE_WORLD_EXTENT;
+        }
+
+        store->x[i] = x;
+        store->y[i] = y;
+    }
+}
+
+uint32_t cull_instances_scalar(const struct instance_store* store, uint32_t begin, uint32_t end, struct instance_view view, struct gpu_instance* out) {
+    uint32_t visible = 0;
+    for (uint32_t i = begin; i < end; i++) {
+        float x = store->x[i] * view.scale_x;
+        float y = store->y[i] * view.scale_y;
+        float width = store->scale[i] * view.scale_x;
+        float height = store->scale[i] * view.scale_y;
+        if (fabsf(x) - width * 0.5f > 1.f || fabsf(y) - height * 0.5f > 1.f) {
+            continue;
+        }
+
+        struct gpu_instance* instance = &out[visible++];
+        instance->position[0] = store->x[i];
+        instance->position[1] = store->y[i];
+        instance->position[2] = store->depth[i];
+        instance->size[0] = store->scale[i];
+        instance->size[1] = store->scale[i];
+        instance->color = store->color[i];
+    }
+
+    return visible;
+}
+
+#if defined(__SSE2__)
+void update_instances_sse2(struct instance_store* store, uint32_t begin, uint32_t end, float dt) {
+    const __m128 step = _mm_set1_ps(dt);
+    const __m128 high = _mm_set1_ps(INSTANCE_WORLD_EXTENT);
+    const __m128 low = _mm_set1_ps(-INSTANCE_WORLD_EXTENT);
+    const __m128 sign = _mm_set1_ps(-0.f);
+
+    uint32_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 velocity_x = _mm_loadu_ps(&store->velocity_x[i]);
+        __m128 velocity_y = _mm_loadu_ps(&store->velocity_y[i]);
+        __m128 x = _mm_add_ps(_mm_loadu_ps(&store->x[i]), _mm_mul_ps(velocity_x, step));
+        __m128 y = _mm_add_ps(_mm_loadu_ps(&store->y[i]), _mm_mul_ps(velocity_y, step));
+
+        __m128 outside_x = _mm_or_ps(_mm_cmplt_ps(x, low), _mm_cmpgt_ps(x, high));
+        __m128 outside_y = _mm_or_ps(_mm_cmplt_ps(y, low), _mm_cmpgt_ps(y, high));
+        _mm_storeu_ps(&store->velocity_x[i], _mm_xor_ps(velocity_x, _mm_and_ps(outside_x, sign)));
+        _mm_storeu_ps(&store->velocity_y[i], _mm_xor_ps(velocity_y, _mm_and_ps(outside_y, sign)));
+        _mm_storeu_ps(&store->x[i], _mm_min_ps(_mm_max_ps(x, low), high));
+        _mm_storeu_ps(&store->y[i], _mm_min_ps(_mm_max_ps(y, low), high));
+    }
+
+    update_instances_scalar(store, i, end, dt);
+}
+
+uint32_t cull_instances_sse2(const struct instance_store* store, uint32_t begin, uint32_t end, struct instance_view view, struct gpu_instance* out) {
+    const __m128 scale_x = _mm_set1_ps(view.scale_x);
+    const __m128 scale_y = _mm_set1_ps(view.scale_y);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+    uint32_t visible = 0;
+    uint32_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 scale = _mm_loadu_ps(&store->scale[i]);
+        __m128 clip_x = _mm_mul_ps(_mm_loadu_ps(&store->x[i]), scale_x);
+        __m128 clip_y = _mm_mul_ps(_mm_loadu_ps(&store->y[i]), scale_y);
+        __m128 clip_width = _mm_mul_ps(scale, scale_x);
+        __m128 clip_height = _mm_mul_ps(scale, scale_y);
+
+        __m128 inside_x = _mm_cmple_ps(_mm_sub_ps(_mm_and_ps(clip_x, abs_mask), _mm_mul_ps(clip_width, half)), one);
+        __m128 inside_y = _mm_cmple_ps(_mm_sub_ps(_mm_and_ps(clip_y, abs_mask), _mm_mul_ps(clip_height, half)), one);
+        int mask = _mm_movemask_ps(_mm_and_ps(inside_x, inside_y));
+        if (mask == 0) {
+            continue;
+        }
+
+        while (mask != 0) {
+            int lane = __builtin_ctz((unsigned)mask);
+            mask &= mask - 1;
+
+            struct gpu_instance* instance = &out[visible++];
+            instance->position[0] = store->x[i + lane];
+            instance->position[1] = store->y[i + lane];
+            instance->position[2] = store->depth[i + lane];
+            instance->size[0] = store->scale[i + lane];
+            instance->size[1] = store->scale[i + lane];
+            instance->color = store->color[i + lane];
+        }
+    }
+
+    return visible + cull_instances_scalar(store, i, end, view, out + visible);
+}
+#endif
+
+#ifdef HAVE_AVX2_KERNELS
+__attribute__((target("avx2")))
+void update_instances_avx2(struct instance_store* store, uint32_t begin, uint32_t end, float dt) {
+    const __m256 step = _mm256_set1_ps(dt);
+    const __m256 high = _mm256_set1_ps(INSTANCE_WORLD_EXTENT);
+    const __m256 low = _mm256_set1_ps(-INSTANCE_WORLD_EXTENT);
+    const __m256 sign = _mm256_set1_ps(-0.f);
+
+    uint32_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 velocity_x = _mm256_loadu_ps(&store->velocity_x[i]);
+        __m256 velocity_y = _mm256_loadu_ps(&store->velocity_y[i]);
+        __m256 x = _mm256_add_ps(_mm256_loadu_ps(&store->x[i]), _mm256_mul_ps(velocity_x, step));
+        __m256 y = _mm256_add_ps(_mm256_loadu_ps(&store->y[i]), _mm256_mul_ps(velocity_y, step));
+
+        __m256 outside_x = _mm256_or_ps(_mm256_cmp_ps(x, low, _CMP_LT_OQ), _mm256_cmp_ps(x, high, _CMP_GT_OQ));
+        __m256 outside_y = _mm256_or_ps(_mm256_cmp_ps(y, low, _CMP_LT_OQ), _mm256_cmp_ps(y, high, _CMP_GT_OQ));
+        _mm256_storeu_ps(&store->velocity_x[i], _mm256_xor_ps(velocity_x, _mm256_and_ps(outside_x, sign)));
+        _mm256_storeu_ps(&store->velocity_y[i], _mm256_xor_ps(velocity_y, _mm256_and_ps(outside_y, sign)));
+        _mm256_storeu_ps(&store->x[i], _mm256_min_ps(_mm256_max_ps(x, low), high));
+        _mm256_storeu_ps(&store->y[i], _mm256_min_ps(_mm256_max_ps(y, low), high));
+    }
+
+    update_instances_scalar(store, i, end, dt);
+}
+
+__attribute__((target("avx2")))
+uint32_t cull_instances_avx2(const struct instance_store* store, uint32_t begin, uint32_t end, struct instance_view view, struct gpu_instance* out) {
+    const __m256 scale_x = _mm256_set1_ps(view.scale_x);
+    const __m256 scale_y = _mm256_set1_ps(view.scale_y);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+
+    uint32_t visible = 0;
+    uint32_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 scale = _mm256_loadu_ps(&store->scale[i]);
+        __m256 clip_x = _mm256_mul_ps(_mm256_loadu_ps(&store->x[i]), scale_x);
+        __m256 clip_y = _mm256_mul_ps(_mm256_loadu_ps(&store->y[i]), scale_y);
+        __m256 clip_width = _mm256_mul_ps(scale, scale_x);
+        __m256 clip_height = _mm256_mul_ps(scale, scale_y);
+
+        __m256 distance_x = _mm256_sub_ps(_mm256_and_ps(clip_x, abs_mask), _mm256_mul_ps(clip_width, half));
+        __m256 distance_y = _mm256_sub_ps(_mm256_and_ps(clip_y, abs_mask), _mm256_mul_ps(clip_height, half));
+        __m256 inside = _mm256_and_ps(_mm256_cmp_ps(distance_x, one, _CMP_LE_OQ), _mm256_cmp_ps(distance_y, one, _CMP_LE_OQ));
+        int mask = _mm256_movemask_ps(inside);
+        if (mask == 0) {
+            continue;
+        }
+
+        while (mask != 0) {
+            int lane = __builtin_ctz((unsigned)mask);
+            mask &= mask - 1;
+
+            struct gpu_instance* instance = &out[visible++];
+            instance->position[0] = store->x[i + lane];
+            instance->position[1] = store->y[i + lane];
+            instance->position[2] = store->depth[i + lane];
+            instance->size[0] = store->scale[i + lane];
+            instance->size[1] = store->scale[i + lane];
+            instance->color = store->color[i + lane];
+        }
+    }
+
+    return visible + cull_instances_scalar(store, i, end, view, out + visible);
+}
+#endif
+
+static const struct instance_kernels instance_kernel_table[] = {
+    {"scalar", update_instances_scalar, cull_instances_scalar},
+#if defined(__SSE2__)
+    {"sse2", update_instances_sse2, cull_instances_sse2},
+#endif
+#ifdef HAVE_AVX2_KERNELS
+    {"avx2", update_instances_avx2, cull_instances_avx2},
+#endif
+};
+
+#define INSTANCE_KERNEL_COUNT (sizeof(instance_kernel_table) / sizeof(instance_kernel_table[0]))
+
+bool instance_kernels_supported(const struct instance_kernels* kernels) {
+#ifdef HAVE_AVX2_KERNELS
+    if (kernels->update == update_instances_avx2) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    (void)kernels;
+    return true;
+}
+
+const struct instance_kernels* select_instance_kernels() {
+    const struct instance_kernels* best = &instance_kernel_table[0];
+    for (uint32_t i = 1; i < INSTANCE_KERNEL_COUNT; i++) {
+        if (instance_kernels_supported(&instance_kernel_table[i])) {
+            best = &instance_kernel_table[i];
+        }
+    }
+
+    return best;
+}
+
+struct instance_view instance_view_for_extent(VkExtent2D extent) {
+    float side = extent.width < extent.height ? extent.width : extent.height;
+    struct instance_view view = {
+        .scale_x = side / extent.width,
+        .scale_y = side / extent.height,
     };
 
-    const VkDynamicState dynamic_states[2] = {
-        VK_DYNAMIC_STATE_VIEWPORT,
-        VK_DYNAMIC_STATE_SCISSOR,
+    return view;
+}
+
+struct batch_options {
+    uint32_t frames;
+    uint32_t max_batch_size;
+    uint32_t max_targets;
+};
+
+static const char* device_extensions[] = {
+    VK_KHR_SWAPCHAIN_EXTENSION_NAME
+};
+
+#define VK_HANDLE_U64(handle) ((uint64_t)(uintptr_t)(handle))
+
+#ifdef DEBUG
+
+#define VK_CHECK(call) vk_check((call), #call, __FILE__, __LINE__)
+#define DEBUG_NAME(type, handle, name) debug_name((type), VK_HANDLE_U64(handle), (name))
+#define DEBUG_LABEL_BEGIN(buffer, name) debug_label_begin((buffer), (name))
+#define DEBUG_LABEL_END(buffer) debug_label_end(buffer)
+
+static const char* validation_layers[] = {
+    "VK_LAYER_KHRONOS_validation"
+};
+
+static bool validation_enabled = false;
+static bool debug_utils_enabled = false;
+static VkDebugUtilsMessengerEXT debug_messenger;
+
+static PFN_vkSetDebugUtilsObjectNameEXT set_debug_utils_object_name;
+static PFN_vkCmdBeginDebugUtilsLabelEXT cmd_begin_debug_utils_label;
+static PFN_vkCmdEndDebugUtilsLabelEXT cmd_end_debug_utils_label;
+
+const char* vk_result_string(VkResult result) {
+    switch (result) {
+        case VK_SUCCESS: return "VK_SUCCESS";
+        case VK_NOT_READY: return "VK_NOT_READY";
+        case VK_TIMEOUT: return "VK_TIMEOUT";
+        case VK_INCOMPLETE: return "VK_INCOMPLETE";
+        case VK_SUBOPTIMAL_KHR: return "VK_SUBOPTIMAL_KHR";
+        case VK_ERROR_OUT_OF_HOST_MEMORY: return "VK_ERROR_OUT_OF_HOST_MEMORY";
+        case VK_ERROR_OUT_OF_DEVICE_MEMORY: return "VK_ERROR_OUT_OF_DEVICE_MEMORY";
+        case VK_ERROR_INITIALIZATION_FAILED: return "VK_ERROR_INITIALIZATION_FAILED";
+        case VK_ERROR_DEVICE_LOST: return "VK_ERROR_DEVICE_LOST";
+        case VK_ERROR_LAYER_NOT_PRESENT: return "VK_ERROR_LAYER_NOT_PRESENT";
+        case VK_ERROR_EXTENSION_NOT_PRESENT: return "VK_ERROR_EXTENSION_NOT_PRESENT";
+        case VK_ERROR_FEATURE_NOT_PRESENT: return "VK_ERROR_FEATURE_NOT_PRESENT";
+        case VK_ERROR_FORMAT_NOT_SUPPORTED: return "VK_ERROR_FORMAT_NOT_SUPPORTED";
+        case VK_ERROR_SURFACE_LOST_KHR: return "VK_ERROR_SURFACE_LOST_KHR";
+        case VK_ERROR_OUT_OF_DATE_KHR: return "VK_ERROR_OUT_OF_DATE_KHR";
+        default: return "VK_ERROR_UNKNOWN";
+    }
+}
+
+VkResult vk_check(VkResult result, const char* call, const char* file, int line) {
+    if (result < 0) {
+        fprintf(stderr, "%s:%d: %s returned %s (%d)\n", file, line, call, vk_result_string(result), result);
+    }
+
+    return result;
+}
+
+VKAPI_ATTR VkBool32 VKAPI_CALL debug_callback(
+    VkDebugUtilsMessageSeverityFlagBitsEXT severity,
+    VkDebugUtilsMessageTypeFlagsEXT type,
+    const VkDebugUtilsMessengerCallbackDataEXT* data,
+    void* user_data
+) {
+    (void)user_data;
+
+    const char* level = "verbose";
+    if (severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT) {
+        level = "error";
+    } else if (severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT) {
+        level = "warning";
+    } else if (severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT) {
+        level = "info";
+    }
+
+    const char* kind = "general";
+    if (type & VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT) {
+        kind = "validation";
+    } else if (type & VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT) {
+        kind = "performance";
+    }
+
+    fprintf(stderr, "[vulkan %s %s] %s\n", kind, level, data->pMessage);
+    return VK_FALSE;
+}
+
+VkDebugUtilsMessengerCreateInfoEXT debug_messenger_create_info() {
+    VkDebugUtilsMessengerCreateInfoEXT create_info = {
+        .sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT,
+        .messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT,
+        .messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT,
+        .pfnUserCallback = debug_callback,
     };
-    VkPipelineDynamicStateCreateInfo dynamic_state_create_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
-        .pDynamicStates = dynamic_states,
-        .dynamicStateCount = 2,
+
+    return create_info;
+}
+
+bool check_layer_support(const char* name) {
+    uint32_t count = 0;
+    VK_CHECK(vkEnumerateInstanceLayerProperties(&count, NULL));
+
+    size_t mark = arena_mark(&ctx.scratch);
+    VkLayerProperties* layers = arena_push(&ctx.scratch, sizeof(VkLayerProperties) * count);
+    if (layers == NULL) {
+        return false;
+    }
+    VK_CHECK(vkEnumerateInstanceLayerProperties(&count, layers));
+
+    bool found = false;
+    for (uint32_t i = 0; i < count && !found; i++) {
+        found = strcmp(layers[i].layerName, name) == 0;
+    }
+
+    arena_reset(&ctx.scratch, mark);
+    return found;
+}
+
+bool check_instance_extension_support(const char* layer, const char* name) {
+    uint32_t count = 0;
+    VK_CHECK(vkEnumerateInstanceExtensionProperties(layer, &count, NULL));
+
+    size_t mark = arena_mark(&ctx.scratch);
+    VkExtensionProperties* extensions = arena_push(&ctx.scratch, sizeof(VkExtensionProperties) * count);
+    if (extensions == NULL) {
+        return false;
+    }
+    VK_CHECK(vkEnumerateInstanceExtensionProperties(layer, &count, extensions));
+
+    bool found = false;
+    for (uint32_t i = 0; i < count && !found; i++) {
+        found = strcmp(extensions[i].extensionName, name) == 0;
+    }
+
+    arena_reset(&ctx.scratch, mark);
+    return found;
+}
+
+VkResult create_debug_messenger() {
+    if (!debug_utils_enabled) {
+        return VK_SUCCESS;
+    }
+
+    set_debug_utils_object_name = (PFN_vkSetDebugUtilsObjectNameEXT)vkGetInstanceProcAddr(ctx.instance, "vkSetDebugUtilsObjectNameEXT");
+    cmd_begin_debug_utils_label = (PFN_vkCmdBeginDebugUtilsLabelEXT)vkGetInstanceProcAddr(ctx.instance, "vkCmdBeginDebugUtilsLabelEXT");
+    cmd_end_debug_utils_label = (PFN_vkCmdEndDebugUtilsLabelEXT)vkGetInstanceProcAddr(ctx.instance, "vkCmdEndDebugUtilsLabelEXT");
+
+    PFN_vkCreateDebugUtilsMessengerEXT create_messenger = (PFN_vkCreateDebugUtilsMessengerEXT)vkGetInstanceProcAddr(ctx.instance, "vkCreateDebugUtilsMessengerEXT");
+    if (create_messenger == NULL) {
+        return VK_ERROR_EXTENSION_NOT_PRESENT;
+    }
+
+    VkDebugUtilsMessengerCreateInfoEXT create_info = debug_messenger_create_info();
+    return VK_CHECK(create_messenger(ctx.instance, &create_info, VK_ALLOCATOR, &debug_messenger));
+}
+
+void destroy_debug_messenger() {
+    if (debug_messenger == VK_NULL_HANDLE) {
+        return;
+    }
+
+    PFN_vkDestroyDebugUtilsMessengerEXT destroy_messenger = (PFN_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(ctx.instance, "vkDestroyDebugUtilsMessengerEXT");
+    if (destroy_messenger != NULL) {
+        destroy_messenger(ctx.instance, debug_messenger, VK_ALLOCATOR);
+    }
+}
+
+void debug_name(VkObjectType type, uint64_t handle, const char* name) {
+    if (set_debug_utils_object_name == NULL || handle == 0) {
+        return;
+    }
+
+    VkDebugUtilsObjectNameInfoEXT name_info = {
+        .sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_OBJECT_NAME_INFO_EXT,
+        .objectType = type,
+        .objectHandle = handle,
+        .pObjectName = name,
     };
 
-    VkPipelineLayoutCreateInfo pipeline_layout_create_info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-        .setLayoutCount = 0,
-        .pushConstantRangeCount = 0,
+    VK_CHECK(set_debug_utils_object_name(ctx.logical_device, &name_info));
+}
+
+void debug_label_begin(VkCommandBuffer buffer, const char* name) {
+    if (cmd_begin_debug_utils_label == NULL) {
+        return;
+    }
+
+    VkDebugUtilsLabelEXT label = {
+        .sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_LABEL_EXT,
+        .pLabelName = name,
+        .color = {1.f, 1.f, 1.f, 1.f},
     };
 
-    vkCreatePipelineLayout(logical_device, &pipeline_layout_create_info, NULL, &pipeline_layout);
+    cmd_begin_debug_utils_label(buffer, &label);
+}
 
-    VkGraphicsPipelineCreateInfo pipeline_create_info = {
-        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
-        .pStages = shader_stages,
-        .stageCount = 2,
+void debug_label_end(VkCommandBuffer buffer) {
+    if (cmd_end_debug_utils_label == NULL) {
+        return;
+    }
+
+    cmd_end_debug_utils_label(buffer);
+}
+
+#else
+
+#define VK_CHECK(call) (call)
+#define DEBUG_NAME(type, handle, name) ((void)0)
+#define DEBUG_LABEL_BEGIN(buffer, name) ((void)0)
+#define DEBUG_LABEL_END(buffer) ((void)0)
+
+#endif
+
+#define VK_HANDLE_FROM_U64(type, value) ((type)(uintptr_t)(value))
+#define TRACK(type, handle) track_handle((type), VK_HANDLE_U64(handle))
+#define DEFER_DESTROY(type, handle) defer_destroy((type), VK_HANDLE_U64(handle))
+
+void track_handle(enum resource_type type, uint64_t handle) {
+    if (handle == 0) {
+        return;
+    }
+
+    // An untracked handle is only leaked at exit, which the validation layer
+    // reports; the pool itself stays intact.
+    struct handle_pool* pool = &ctx.pools[type];
+    if (pool->count == pool->capacity) {
+        uint32_t capacity = pool->capacity == 0 ? 16 : pool->capacity * 2;
+        uint64_t* handles = host_realloc(pool->handles, sizeof(uint64_t) * capacity);
+        if (handles == NULL) {
+            printf("Failed to track handle of resource type %u\n", (uint32_t)type);
+            return;
+        }
+
+        pool->handles = handles;
+        pool->capacity = capacity;
+    }
+
+    pool->handles[pool->count++] = handle;
+}
+
+bool untrack_handle(enum resource_type type, uint64_t handle) {
+    struct handle_pool* pool = &ctx.pools[type];
+    for (uint32_t i = pool->count; i > 0; i--) {
+        if (pool->handles[i - 1] != handle) {
+            continue;
+        }
+
+        pool->handles[i - 1] = pool->handles[--pool->count];
+        return true;
+    }
+
+    return false;
+}
+
+void destroy_handle(enum resource_type type, uint64_t handle) {
+    VkDevice device = ctx.logical_device;
+    switch (type) {
+        case RESOURCE_FRAMEBUFFER:
+            vkDestroyFramebuffer(device, VK_HANDLE_FROM_U64(VkFramebuffer, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_PIPELINE:
+            vkDestroyPipeline(device, VK_HANDLE_FROM_U64(VkPipeline, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_PIPELINE_LAYOUT:
+            vkDestroyPipelineLayout(device, VK_HANDLE_FROM_U64(VkPipelineLayout, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_PIPELINE_CACHE:
+            vkDestroyPipelineCache(device, VK_HANDLE_FROM_U64(VkPipelineCache, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_SHADER_MODULE:
+            vkDestroyShaderModule(device, VK_HANDLE_FROM_U64(VkShaderModule, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_DESCRIPTOR_POOL:
+            vkDestroyDescriptorPool(device, VK_HANDLE_FROM_U64(VkDescriptorPool, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_DESCRIPTOR_SET_LAYOUT:
+            vkDestroyDescriptorSetLayout(device, VK_HANDLE_FROM_U64(VkDescriptorSetLayout, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_SAMPLER:
+            vkDestroySampler(device, VK_HANDLE_FROM_U64(VkSampler, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_QUERY_POOL:
+            vkDestroyQueryPool(device, VK_HANDLE_FROM_U64(VkQueryPool, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_RENDER_PASS:
+            vkDestroyRenderPass(device, VK_HANDLE_FROM_U64(VkRenderPass, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_IMAGE_VIEW:
+            vkDestroyImageView(device, VK_HANDLE_FROM_U64(VkImageView, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_IMAGE:
+            vkDestroyImage(device, VK_HANDLE_FROM_U64(VkImage, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_BUFFER:
+            vkDestroyBuffer(device, VK_HANDLE_FROM_U64(VkBuffer, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_DEVICE_MEMORY:
+            vkFreeMemory(device, VK_HANDLE_FROM_U64(VkDeviceMemory, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_SWAP_CHAIN:
+            vkDestroySwapchainKHR(device, VK_HANDLE_FROM_U64(VkSwapchainKHR, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_SEMAPHORE:
+            vkDestroySemaphore(device, VK_HANDLE_FROM_U64(VkSemaphore, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_FENCE:
+            vkDestroyFence(device, VK_HANDLE_FROM_U64(VkFence, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_COMMAND_POOL:
+            vkDestroyCommandPool(device, VK_HANDLE_FROM_U64(VkCommandPool, handle), VK_ALLOCATOR);
+            break;
+        case RESOURCE_TYPE_COUNT:
+            break;
+    }
+}
+
+void defer_destroy(enum resource_type type, uint64_t handle) {
+    if (handle == 0 || !untrack_handle(type, handle)) {
+        return;
+    }
+
+    // Without room to defer it, the handle is destroyed once the frames that
+    // might use it are done. Only the main thread submits to the graphics
+    // queue, so it can wait on it while the texture loader keeps running.
+    struct deletion_queue* queue = &ctx.deletion_queue;
+    if (queue->count == queue->capacity) {
+        uint32_t capacity = queue->capacity == 0 ? 64 : queue->capacity * 2;
+        struct deferred_destroy* entries = host_realloc(queue->entries, sizeof(struct deferred_destroy) * capacity);
+        if (entries == NULL) {
+            puts("Failed to grow the deletion queue, waiting for the graphics queue");
+            VK_CHECK(vkQueueWaitIdle(ctx.graphics_queue));
+            destroy_handle(type, handle);
+            return;
+        }
+
+        queue->entries = entries;
+        queue->capacity = capacity;
+    }
+
+    struct deferred_destroy entry = {
+        .type = type,
+        .handle = handle,
+        .serial = ctx.frame_serial,
+    };
+    queue->entries[queue->count++] = entry;
+}
+
+void collect_garbage() {
+    struct deletion_queue* queue = &ctx.deletion_queue;
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < queue->count; i++) {
+        struct deferred_destroy entry = queue->entries[i];
+        if (entry.serial > ctx.completed_serial) {
+            queue->entries[kept++] = entry;
+            continue;
+        }
+
+        destroy_handle(entry.type, entry.handle);
+    }
+
+    queue->count = kept;
+}
+
+void destroy_all_handles() {
+    struct deletion_queue* queue = &ctx.deletion_queue;
+    for (uint32_t i = 0; i < queue->count; i++) {
+        destroy_handle(queue->entries[i].type, queue->entries[i].handle);
+    }
+
+    host_free(queue->entries);
+    memset(queue, 0, sizeof(struct deletion_queue));
+
+    for (uint32_t type = 0; type < RESOURCE_TYPE_COUNT; type++) {
+        struct handle_pool* pool = &ctx.pools[type];
+        for (uint32_t i = pool->count; i > 0; i--) {
+            destroy_handle(type, pool->handles[i - 1]);
+        }
+
+        host_free(pool->handles);
+        memset(pool, 0, sizeof(struct handle_pool));
+    }
+}
+
+bool all_outputs_iconified() {
+    for (uint32_t i = 0; i < ctx.outputs_count; i++) {
+        if (!ctx.outputs[i].iconified) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool outputs_should_close() {
+    for (uint32_t i = 0; i < ctx.outputs_count; i++) {
+        if (glfwWindowShouldClose(ctx.outputs[i].window)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void frame_buffer_size_callback(GLFWwindow* window, int width, int height) {
+    (void)width;
+    (void)height;
+    struct output* output = glfwGetWindowUserPointer(window);
+    output->resized = true;
+    ctx.pacing.dirty = true;
+}
+
+void window_refresh_callback(GLFWwindow* window) {
+    (void)window;
+    ctx.pacing.dirty = true;
+}
+
+void window_iconify_callback(GLFWwindow* window, int iconified) {
+    struct output* output = glfwGetWindowUserPointer(window);
+    output->iconified = iconified == GLFW_TRUE;
+    ctx.pacing.iconified = all_outputs_iconified();
+    ctx.pacing.dirty = true;
+}
+
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    (void)window;
+    (void)scancode;
+    (void)mods;
+    if (key == GLFW_KEY_R && action == GLFW_PRESS) {
+        ctx.reload_pipeline = true;
+        ctx.pacing.dirty = true;
+    }
+    if (key == GLFW_KEY_SPACE && action == GLFW_PRESS) {
+        ctx.animation_paused = !ctx.animation_paused;
+        ctx.last_update = 0.0;
+        ctx.pacing.dirty = true;
+    }
+}
+
+void init_window() {
+    glfwInit();
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    glfwWindowHint(GLFW_RESIZABLE, ctx.replay.data == NULL ? GLFW_TRUE : GLFW_FALSE);
+    glfwWindowHint(GLFW_FLOATING, GLFW_TRUE);
+
+    // Replay windows open at the captured extents, which every frame must match.
+    for (uint32_t i = 0; i < ctx.outputs_count; i++) {
+        struct output* output = &ctx.outputs[i];
+        VkExtent2D extent = {WINDOW_WIDTH, WINDOW_HEIGHT};
+        if (ctx.replay.data != NULL) {
+            extent = ctx.replay.header->extents[i];
+        }
+
+        output->window = glfwCreateWindow(extent.width, extent.height, "Meow :3", NULL, NULL);
+        if (ctx.outputs_count > 1) {
+            glfwSetWindowPos(output->window, 32 + i * (WINDOW_WIDTH / 2), 32 + i * (WINDOW_HEIGHT / 8));
+        }
+
+        glfwSetWindowUserPointer(output->window, output);
+        glfwSetFramebufferSizeCallback(output->window, frame_buffer_size_callback);
+        glfwSetKeyCallback(output->window, key_callback);
+        glfwSetWindowRefreshCallback(output->window, window_refresh_callback);
+        glfwSetWindowIconifyCallback(output->window, window_iconify_callback);
+    }
+}
+
+uint32_t clamp(uint32_t number, uint32_t min, uint32_t max) {
+    if (number < min) {
+        return min;
+    }
+
+    if (number > max) {
+        return max;
+    }
+
+    return number;
+}
+
+char* read_file(char* path, uint32_t* size, struct arena* arena) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Failed to open %s\n", path);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+
+    char* ret = arena_push_zero(arena, *size + 1);
+    if (ret != NULL && fread(ret, sizeof(char), *size, file) != *size) {
+        printf("Failed to read %s\n", path);
+        ret = NULL;
+    }
+
+    fclose(file);
+    return ret;
+}
+
+struct queue_family_indices find_queue_families(VkPhysicalDevice* device) {
+    struct queue_family_indices indices = {0};
+    uint32_t family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(*device, &family_count, NULL);
+
+    size_t mark = arena_mark(&ctx.scratch);
+    VkQueueFamilyProperties* families = arena_push(&ctx.scratch, sizeof(VkQueueFamilyProperties) * family_count);
+    if (families == NULL) {
+        return indices;
+    }
+    vkGetPhysicalDeviceQueueFamilyProperties(*device, &family_count, families);
+    for (uint32_t i = 0; i < family_count; i++) {
+        VkQueueFamilyProperties family = families[i];
+        if (family.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+            indices.graphics_family.value = i;
+            indices.graphics_family.assigned = true;
+        }
+
+        VkBool32 present_support = false;
+        if (ctx.headless) {
+            present_support = (family.queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+        } else {
+            present_support = VK_TRUE;
+            for (uint32_t o = 0; o < ctx.outputs_count && present_support; o++) {
+                VK_CHECK(vkGetPhysicalDeviceSurfaceSupportKHR(*device, i, ctx.outputs[o].surface, &present_support));
+            }
+        }
+        if (present_support) {
+            indices.present_family.value = i;
+            indices.present_family.assigned = true;
+        }
+        
+        if (indices.graphics_family.assigned && indices.present_family.assigned) {
+            break;
+        }
+    }
+
+    if (indices.graphics_family.assigned) {
+        indices.transfer_family = indices.graphics_family;
+        indices.graphics_queue_count = families[indices.graphics_family.value].queueCount;
+        indices.timestamp_bits = families[indices.graphics_family.value].timestampValidBits;
+        for (uint32_t i = 0; i < family_count; i++) {
+            VkQueueFlags flags = families[i].queueFlags;
+            if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+                indices.transfer_family.value = i;
+                break;
+            }
+        }
+    }
+
+    arena_reset(&ctx.scratch, mark);
+
+    return indices;
+}
+
+VkResult create_logical_device() {
+    struct queue_family_indices indices = ctx.queue_families;
+    float priority = 1.f;
+
+    float priorities[2] = {priority, priority};
+
+    uint32_t unique_count = 1;
+    uint32_t transfer_index = 0;
+    VkDeviceQueueCreateInfo queue_create_infos[3];
+    VkDeviceQueueCreateInfo graphics_queue_create_info = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = indices.graphics_family.value,
+        .queueCount = 1,
+        .pQueuePriorities = priorities,
+    };
+
+    VkDeviceQueueCreateInfo present_queue_create_info = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = indices.present_family.value,
+        .queueCount = 1,
+        .pQueuePriorities = &priority,
+    };
+
+    VkDeviceQueueCreateInfo transfer_queue_create_info = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = indices.transfer_family.value,
+        .queueCount = 1,
+        .pQueuePriorities = &priority,
+    };
+
+    if (indices.transfer_family.value == indices.graphics_family.value && indices.graphics_queue_count >= 2) {
+        graphics_queue_create_info.queueCount = 2;
+        transfer_index = 1;
+    }
+
+    queue_create_infos[0] = graphics_queue_create_info;
+    if (indices.present_family.value != indices.graphics_family.value) {
+        queue_create_infos[unique_count++] = present_queue_create_info;
+    }
+
+    if (indices.transfer_family.value != indices.graphics_family.value && indices.transfer_family.value != indices.present_family.value) {
+        queue_create_infos[unique_count++] = transfer_queue_create_info;
+    }
+
+    VkPhysicalDeviceFeatures features;
+    memset(&features, VK_FALSE, sizeof(VkPhysicalDeviceFeatures));
+    features.shaderSampledImageArrayDynamicIndexing = VK_TRUE;
+
+    VkPhysicalDeviceFeatures supported;
+    vkGetPhysicalDeviceFeatures(ctx.physical_device, &supported);
+    features.pipelineStatisticsQuery = supported.pipelineStatisticsQuery;
+    ctx.statistics_supported = supported.pipelineStatisticsQuery == VK_TRUE;
+
+    size_t extension_count = ctx.headless ? 0 : sizeof(device_extensions) / sizeof(char*);
+    VkDeviceCreateInfo device_create_info = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .pQueueCreateInfos = queue_create_infos,
+        .queueCreateInfoCount = unique_count,
+        .pEnabledFeatures = &features,
+        .enabledLayerCount = 0,
+        .enabledExtensionCount = extension_count,
+        .ppEnabledExtensionNames = device_extensions,
+    };
+
+#ifdef DEBUG
+    if (validation_enabled) {
+        device_create_info.enabledLayerCount = sizeof(validation_layers) / sizeof(char*);
+        device_create_info.ppEnabledLayerNames = validation_layers;
+    }
+#endif
+
+    VkResult out = VK_CHECK(vkCreateDevice(ctx.physical_device, &device_create_info, VK_ALLOCATOR, &ctx.logical_device));
+    if (out != VK_SUCCESS) {
+        return out;
+    }
+
+    vkGetDeviceQueue(ctx.logical_device, indices.graphics_family.value, 0, &ctx.graphics_queue);
+    vkGetDeviceQueue(ctx.logical_device, indices.present_family.value, 0, &ctx.present_queue);
+    vkGetDeviceQueue(ctx.logical_device, indices.transfer_family.value, transfer_index, &ctx.transfer_queue);
+    ctx.transfer_queue_shared = ctx.transfer_queue == ctx.graphics_queue || ctx.transfer_queue == ctx.present_queue;
+
+    DEBUG_NAME(VK_OBJECT_TYPE_DEVICE, ctx.logical_device, "Logical device");
+    DEBUG_NAME(VK_OBJECT_TYPE_QUEUE, ctx.graphics_queue, "Graphics queue");
+    if (ctx.present_queue != ctx.graphics_queue) {
+        DEBUG_NAME(VK_OBJECT_TYPE_QUEUE, ctx.present_queue, "Present queue");
+    }
+
+    return VK_SUCCESS;
+}
+
+VkExtent2D choose_swap_chain_extent(struct output* output, VkSurfaceCapabilitiesKHR* capabilities) {
+    if (capabilities->currentExtent.width != UINT_MAX) {
+        return capabilities->currentExtent;
+    }
+
+    int width, height;
+    glfwGetFramebufferSize(output->window, &width, &height);
+
+    VkExtent2D extent = {
+        .width = width,
+        .height = height,
+    };
+
+    extent.width = clamp(extent.width, capabilities->minImageExtent.width, capabilities->maxImageExtent.width);
+    extent.height = clamp(extent.height, capabilities->minImageExtent.height, capabilities->maxImageExtent.height);
+    return extent;
+}
+
+VkPresentModeKHR choose_swap_chain_present_mode(VkPresentModeKHR* modes, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        VkPresentModeKHR mode = modes[i];
+        if (mode != VK_PRESENT_MODE_MAILBOX_KHR) {
+            continue;
+        }
+
+        return mode;
+    }
+
+    return VK_PRESENT_MODE_FIFO_KHR;
+}
+
+VkSurfaceFormatKHR choose_swap_chain_surface_format(VkSurfaceFormatKHR* formats, uint32_t count) {
+    // Outputs share one render pass, so once a format is in use the rest follow it.
+    VkFormat preferred = ctx.color_format != VK_FORMAT_UNDEFINED ? ctx.color_format : VK_FORMAT_R8G8B8A8_SRGB;
+    for (uint32_t i = 0; i < count; i++) {
+        VkSurfaceFormatKHR format = formats[i];
+        if (format.format != preferred) {
+            continue;
+        }
+
+        if (format.colorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
+            continue;
+        }
+
+        return format;
+    }
+
+    return formats[0];
+}
+
+struct swap_chain_support_details query_swap_chain_details(VkPhysicalDevice* device, VkSurfaceKHR surface, struct arena* arena) {
+    struct swap_chain_support_details details = {0};
+
+    VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(*device, surface, &details.capabilities));
+
+    VK_CHECK(vkGetPhysicalDeviceSurfaceFormatsKHR(*device, surface, &details.formats_count, NULL));
+    if (details.formats_count != 0) {
+        details.formats = arena_push(arena, sizeof(VkSurfaceFormatKHR) * details.formats_count);
+        if (details.formats == NULL) {
+            details.formats_count = 0;
+            return details;
+        }
+        VK_CHECK(vkGetPhysicalDeviceSurfaceFormatsKHR(*device, surface, &details.formats_count, details.formats));
+    }
+
+    VK_CHECK(vkGetPhysicalDeviceSurfacePresentModesKHR(*device, surface, &details.present_modes_count, NULL)); 
+    if (details.present_modes_count != 0) {
+        details.present_modes = arena_push(arena, sizeof(VkPresentModeKHR) * details.present_modes_count);
+        if (details.present_modes == NULL) {
+            details.present_modes_count = 0;
+            return details;
+        }
+        VK_CHECK(vkGetPhysicalDeviceSurfacePresentModesKHR(*device, surface, &details.present_modes_count, details.present_modes));
+    }
+
+    return details;
+}
+
+VkResult create_swap_chain(struct output* output, VkSwapchainKHR old_swap_chain) {
+    struct swap_chain* swap_chain = &output->swap_chain;
+    struct swap_chain_support_details details = output->surface_details;
+    VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(ctx.physical_device, output->surface, &details.capabilities));
+
+    VkSurfaceFormatKHR surface_format = choose_swap_chain_surface_format(details.formats, details.formats_count);
+    VkPresentModeKHR present_mode = choose_swap_chain_present_mode(details.present_modes, details.present_modes_count);
+    VkExtent2D extent = choose_swap_chain_extent(output, &details.capabilities);
+
+    uint32_t image_count = details.capabilities.minImageCount + 1;
+    if (details.capabilities.maxImageCount > 0 && image_count > details.capabilities.maxImageCount) {
+        image_count = details.capabilities.maxImageCount;
+    }
+
+    VkSwapchainCreateInfoKHR create_info = {
+        .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+        .surface = output->surface,
+        .minImageCount = image_count,
+        .imageFormat = surface_format.format,
+        .imageColorSpace = surface_format.colorSpace,
+        .imageExtent = extent,
+        .imageArrayLayers = 1,
+        .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+        .preTransform = details.capabilities.currentTransform,
+        .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+        .presentMode = present_mode,
+        .clipped = VK_TRUE,
+        .oldSwapchain = old_swap_chain
+    };
+
+    struct queue_family_indices indices = ctx.queue_families;
+    uint32_t family_indices[2] = {
+        indices.graphics_family.value, 
+        indices.present_family.value
+    };
+
+    if (indices.graphics_family.value != indices.present_family.value) {
+        create_info.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
+        create_info.queueFamilyIndexCount = 2;
+        create_info.pQueueFamilyIndices = family_indices;
+    } else {
+        create_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    }
+
+    VkResult result = VK_CHECK(vkCreateSwapchainKHR(ctx.logical_device, &create_info, VK_ALLOCATOR, &swap_chain->handle));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_SWAP_CHAIN, swap_chain->handle);
+
+    VK_CHECK(vkGetSwapchainImagesKHR(ctx.logical_device, swap_chain->handle, &swap_chain->images_count, NULL));
+    swap_chain->images = host_calloc(swap_chain->images_count, sizeof(VkImage));
+    VK_CHECK(vkGetSwapchainImagesKHR(ctx.logical_device, swap_chain->handle, &swap_chain->images_count, swap_chain->images));
+
+    DEBUG_NAME(VK_OBJECT_TYPE_SWAPCHAIN_KHR, swap_chain->handle, "Swap chain");
+    for (uint32_t i = 0; i < swap_chain->images_count; i++) {
+        DEBUG_NAME(VK_OBJECT_TYPE_IMAGE, swap_chain->images[i], "Swap chain image");
+    }
+
+    swap_chain->format = surface_format.format;
+    swap_chain->extent = extent;
+
+    VkSemaphoreCreateInfo semaphore_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    };
+
+    swap_chain->render_finished_semaphores = host_calloc(swap_chain->images_count, sizeof(VkSemaphore));
+    for (uint32_t i = 0; i < swap_chain->images_count; i++) {
+        result = VK_CHECK(vkCreateSemaphore(ctx.logical_device, &semaphore_info, VK_ALLOCATOR, &swap_chain->render_finished_semaphores[i]));
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+
+        TRACK(RESOURCE_SEMAPHORE, swap_chain->render_finished_semaphores[i]);
+        DEBUG_NAME(VK_OBJECT_TYPE_SEMAPHORE, swap_chain->render_finished_semaphores[i], "Render finished semaphore");
+    }
+
+    return result;
+}
+
+VkResult create_image_view(struct output* output) {
+    struct swap_chain* swap_chain = &output->swap_chain;
+    swap_chain->image_views = host_calloc(swap_chain->images_count, sizeof(VkImageView));
+    for (uint32_t i = 0; i < swap_chain->images_count; i++) {
+        VkImageViewCreateInfo create_info = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .image = swap_chain->images[i],
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = swap_chain->format,
+            .components.r = VK_COMPONENT_SWIZZLE_IDENTITY,
+            .components.g = VK_COMPONENT_SWIZZLE_IDENTITY,
+            .components.b = VK_COMPONENT_SWIZZLE_IDENTITY,
+            .components.a = VK_COMPONENT_SWIZZLE_IDENTITY,
+            .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .subresourceRange.baseMipLevel = 0,
+            .subresourceRange.levelCount = 1,
+            .subresourceRange.baseArrayLayer = 0,
+            .subresourceRange.layerCount = 1
+        };
+        VkResult result = VK_CHECK(vkCreateImageView(ctx.logical_device, &create_info, VK_ALLOCATOR, &swap_chain->image_views[i]));
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+
+        TRACK(RESOURCE_IMAGE_VIEW, swap_chain->image_views[i]);
+        DEBUG_NAME(VK_OBJECT_TYPE_IMAGE_VIEW, swap_chain->image_views[i], "Swap chain image view");
+    }
+
+    return VK_SUCCESS;
+}
+
+bool depth_format_has_stencil(VkFormat format) {
+    return format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT;
+}
+
+VkFormat choose_depth_format() {
+    const VkFormat candidates[] = {
+        VK_FORMAT_D32_SFLOAT,
+        VK_FORMAT_D32_SFLOAT_S8_UINT,
+        VK_FORMAT_D24_UNORM_S8_UINT,
+        VK_FORMAT_D16_UNORM,
+    };
+
+    for (uint32_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(ctx.physical_device, candidates[i], &properties);
+        if (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+            return candidates[i];
+        }
+    }
+
+    return VK_FORMAT_UNDEFINED;
+}
+
+// Picks the highest count up to the requested one that both colour and depth
+// frame buffers support; one sample is always available.
+VkSampleCountFlagBits choose_sample_count(VkSampleCountFlagBits requested) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(ctx.physical_device, &properties);
+    VkSampleCountFlags supported = properties.limits.framebufferColorSampleCounts & properties.limits.framebufferDepthSampleCounts;
+
+    for (uint32_t samples = requested; samples > 1; samples >>= 1) {
+        if (supported & samples) {
+            return (VkSampleCountFlagBits)samples;
+        }
+    }
+
+    return VK_SAMPLE_COUNT_1_BIT;
+}
+
+VkResult create_render_pass() {
+    bool multisampled = ctx.samples > VK_SAMPLE_COUNT_1_BIT;
+    VkImageLayout present_layout = ctx.headless ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    VkAttachmentDescription attachments[3];
+    VkAttachmentDescription color_attachment = {
+        .format = ctx.color_format,
+        .samples = ctx.samples,
+        .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+        .storeOp = multisampled ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE,
+        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .finalLayout = multisampled ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : present_layout,
+    };
+
+    // Depth is only needed inside the pass, so it is never loaded or stored.
+    VkAttachmentDescription depth_attachment = {
+        .format = ctx.depth_format,
+        .samples = ctx.samples,
+        .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+        .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    };
+
+    // With multisampling the samples stay in a transient image and only the
+    // resolved colour reaches the swap chain or offscreen target.
+    VkAttachmentDescription resolve_attachment = {
+        .format = ctx.color_format,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .finalLayout = present_layout,
+    };
+
+    attachments[0] = color_attachment;
+    attachments[1] = depth_attachment;
+    attachments[2] = resolve_attachment;
+
+    VkAttachmentReference attachment_reference = {
+        .attachment = 0,
+        .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    };
+
+    VkAttachmentReference depth_reference = {
+        .attachment = 1,
+        .layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+    };
+
+    VkAttachmentReference resolve_reference = {
+        .attachment = 2,
+        .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    };
+
+    VkSubpassDescription subpass = {
+        .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+        .pColorAttachments = &attachment_reference,
+        .colorAttachmentCount = 1,
+        .pResolveAttachments = multisampled ? &resolve_reference : NULL,
+        .pDepthStencilAttachment = &depth_reference,
+    };
+
+    // Frames in flight share one depth image, so the clear has to wait for the
+    // previous pass's depth writes as well as its colour writes.
+    VkSubpassDependency dependancy = {
+        .srcSubpass = VK_SUBPASS_EXTERNAL,
+        .dstSubpass = 0,
+        .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+            VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+        .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+        .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+            VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+        .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+    };
+
+    VkRenderPassCreateInfo render_pass_info = {
+        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+        .pAttachments = attachments,
+        .attachmentCount = multisampled ? 3 : 2,
+        .pSubpasses = &subpass,
+        .subpassCount = 1,
+        .pDependencies = &dependancy,
+        .dependencyCount = 1,
+    };
+
+    VkResult result = VK_CHECK(vkCreateRenderPass(ctx.logical_device, &render_pass_info, VK_ALLOCATOR, &ctx.render_pass));
+    TRACK(RESOURCE_RENDER_PASS, ctx.render_pass);
+    DEBUG_NAME(VK_OBJECT_TYPE_RENDER_PASS, ctx.render_pass, "Main render pass");
+    return result;
+}
+
+VkShaderModule create_shader_module(char* binary, uint32_t size) {
+    VkShaderModuleCreateInfo create_info = {
+        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+        .pCode = (uint32_t*)binary,
+        .codeSize = size 
+    };
+
+    VkShaderModule shader_module = VK_NULL_HANDLE;
+    if (VK_CHECK(vkCreateShaderModule(ctx.logical_device, &create_info, VK_ALLOCATOR, &shader_module)) != VK_SUCCESS) {
+        return VK_NULL_HANDLE;
+    }
+
+    return shader_module;
+}
+
+VkResult create_pipeline_cache() {
+    VkPipelineCacheCreateInfo create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+    };
+
+    VkResult result = VK_CHECK(vkCreatePipelineCache(ctx.logical_device, &create_info, VK_ALLOCATOR, &ctx.pipeline_cache));
+    TRACK(RESOURCE_PIPELINE_CACHE, ctx.pipeline_cache);
+    DEBUG_NAME(VK_OBJECT_TYPE_PIPELINE_CACHE, ctx.pipeline_cache, "Pipeline cache");
+    return result;
+}
+
+VkResult load_shader_modules(VkShaderModule* vertex_shader, VkShaderModule* fragment_shader) {
+    uint32_t vertex_shader_size;
+    uint32_t fragment_shader_size;
+
+    size_t mark = arena_mark(&ctx.scratch);
+    char* vertex_shader_code = read_file("./shaders/vert.spv", &vertex_shader_size, &ctx.scratch);
+    char* fragment_shader_code = read_file("./shaders/frag.spv", &fragment_shader_size, &ctx.scratch);
+    if (vertex_shader_code == NULL || fragment_shader_code == NULL) {
+        arena_reset(&ctx.scratch, mark);
+        return VK_ERROR_INITIALIZATION_FAILED;
+    }
+
+    *vertex_shader = create_shader_module(vertex_shader_code, vertex_shader_size);
+    *fragment_shader = create_shader_module(fragment_shader_code, fragment_shader_size);
+    arena_reset(&ctx.scratch, mark);
+
+    if (*vertex_shader == VK_NULL_HANDLE || *fragment_shader == VK_NULL_HANDLE) {
+        vkDestroyShaderModule(ctx.logical_device, *vertex_shader, VK_ALLOCATOR);
+        vkDestroyShaderModule(ctx.logical_device, *fragment_shader, VK_ALLOCATOR);
+        return VK_ERROR_INITIALIZATION_FAILED;
+    }
+
+    return VK_SUCCESS;
+}
+
+VkResult create_pipeline_layout() {
+    // The view scale differs per output, so it is pushed rather than baked into the instances.
+    VkPushConstantRange push_constant_ranges[2] = {
+        {
+            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+            .offset = 0,
+            .size = sizeof(struct instance_view),
+        },
+        {
+            .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+            .offset = sizeof(struct instance_view),
+            .size = sizeof(uint32_t),
+        },
+    };
+
+    VkPipelineLayoutCreateInfo pipeline_layout_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &ctx.descriptor_set_layout,
+        .pushConstantRangeCount = 2,
+        .pPushConstantRanges = push_constant_ranges,
+    };
+
+    VkResult result = VK_CHECK(vkCreatePipelineLayout(ctx.logical_device, &pipeline_layout_create_info, VK_ALLOCATOR, &ctx.pipeline_layout));
+    TRACK(RESOURCE_PIPELINE_LAYOUT, ctx.pipeline_layout);
+    DEBUG_NAME(VK_OBJECT_TYPE_PIPELINE_LAYOUT, ctx.pipeline_layout, "Triangle pipeline layout");
+    return result;
+}
+
+// The generic pipeline can draw any group, so it stands in while a variant compiles.
+struct pipeline_state generic_pipeline_state() {
+    struct pipeline_state state = {
+        .cull_mode = VK_CULL_MODE_BACK_BIT,
+        .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+        .samples = ctx.samples,
+        .blend = PIPELINE_BLEND_NONE,
+        .features = PIPELINE_FEATURE_TEXTURE | PIPELINE_FEATURE_VERTEX_COLOR,
+    };
+
+    return state;
+}
+
+// Only reads shared state, so the pipeline workers call it concurrently; the
+// pipeline cache is internally synchronised.
+VkResult compile_pipeline(const struct pipeline_state* state, VkPipeline* pipeline) {
+    VkSpecializationMapEntry specialization_entries[2] = {
+        {.constantID = 0, .offset = 0, .size = sizeof(VkBool32)},
+        {.constantID = 1, .offset = sizeof(VkBool32), .size = sizeof(VkBool32)},
+    };
+    VkBool32 specialization_data[2] = {
+        (state->features & PIPELINE_FEATURE_TEXTURE) != 0,
+        (state->features & PIPELINE_FEATURE_VERTEX_COLOR) != 0,
+    };
+    VkSpecializationInfo specialization_info = {
+        .mapEntryCount = 2,
+        .pMapEntries = specialization_entries,
+        .dataSize = sizeof(specialization_data),
+        .pData = specialization_data,
+    };
+
+    VkPipelineShaderStageCreateInfo vertex_shader_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .stage = VK_SHADER_STAGE_VERTEX_BIT,
+        .module = ctx.vertex_shader,
+        .pName = "main",
+        .pSpecializationInfo = &specialization_info,
+    };
+
+    VkPipelineShaderStageCreateInfo fragment_shader_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+        .module = ctx.fragment_shader,
+        .pName = "main",
+        .pSpecializationInfo = &specialization_info,
+    };
+
+    VkPipelineShaderStageCreateInfo shader_stages[2] = {
+        vertex_shader_create_info,
+        fragment_shader_create_info
+    };
+
+    VkVertexInputBindingDescription instance_binding = {
+        .binding = 0,
+        .stride = sizeof(struct gpu_instance),
+        .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
+    };
+
+    VkVertexInputAttributeDescription instance_attributes[3] = {
+        {
+            .location = 0,
+            .binding = 0,
+            .format = VK_FORMAT_R32G32B32_SFLOAT,
+            .offset = offsetof(struct gpu_instance, position),
+        },
+        {
+            .location = 1,
+            .binding = 0,
+            .format = VK_FORMAT_R32G32_SFLOAT,
+            .offset = offsetof(struct gpu_instance, size),
+        },
+        {
+            .location = 2,
+            .binding = 0,
+            .format = VK_FORMAT_R8G8B8A8_UNORM,
+            .offset = offsetof(struct gpu_instance, color),
+        },
+    };
+
+    VkPipelineVertexInputStateCreateInfo vertex_input_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+        .vertexBindingDescriptionCount = 1,
+        .pVertexBindingDescriptions = &instance_binding,
+        .vertexAttributeDescriptionCount = 3,
+        .pVertexAttributeDescriptions = instance_attributes,
+    };
+
+    // Three vertices make the same triangle as a list or a strip.
+    VkPipelineInputAssemblyStateCreateInfo input_assembly_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+        .topology = state->topology,
+        .primitiveRestartEnable = VK_FALSE,
+    };
+
+    VkPipelineViewportStateCreateInfo viewport_state_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+        .viewportCount = 1,
+        .scissorCount = 1,
+    };
+
+    VkPipelineRasterizationStateCreateInfo rasterizer_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+        .depthBiasClamp = VK_FALSE,
+        .rasterizerDiscardEnable = VK_FALSE,
+        .polygonMode = VK_POLYGON_MODE_FILL,
+        .lineWidth = 1.f,
+        .cullMode = state->cull_mode,
+        .frontFace = VK_FRONT_FACE_CLOCKWISE,
+        .depthBiasEnable = VK_FALSE,
+    };
+
+    VkPipelineMultisampleStateCreateInfo multisampling_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+        .sampleShadingEnable = VK_FALSE,
+        .rasterizationSamples = state->samples,
+    };
+
+    // Blended variants still test against opaque depth but leave it untouched.
+    bool blended = state->blend != PIPELINE_BLEND_NONE;
+    VkPipelineDepthStencilStateCreateInfo depth_stencil_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+        .depthTestEnable = VK_TRUE,
+        .depthWriteEnable = blended ? VK_FALSE : VK_TRUE,
+        .depthCompareOp = VK_COMPARE_OP_LESS,
+        .depthBoundsTestEnable = VK_FALSE,
+        .stencilTestEnable = VK_FALSE,
+    };
+
+    VkPipelineColorBlendAttachmentState color_blend_attachment = {
+        .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
+        .blendEnable = blended ? VK_TRUE : VK_FALSE,
+        .srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA,
+        .dstColorBlendFactor = state->blend == PIPELINE_BLEND_ADDITIVE ? VK_BLEND_FACTOR_ONE : VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+        .colorBlendOp = VK_BLEND_OP_ADD,
+        .srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
+        .dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+        .alphaBlendOp = VK_BLEND_OP_ADD,
+    };
+
+    VkPipelineColorBlendStateCreateInfo color_blend_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+        .logicOpEnable = VK_FALSE,
+        .logicOp = VK_LOGIC_OP_COPY,
+        .attachmentCount = 1,
+        .pAttachments = &color_blend_attachment,
+    };
+
+    const VkDynamicState dynamic_states[2] = {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR,
+    };
+    VkPipelineDynamicStateCreateInfo dynamic_state_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+        .pDynamicStates = dynamic_states,
+        .dynamicStateCount = 2,
+    };
+
+    VkGraphicsPipelineCreateInfo pipeline_create_info = {
+        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        .pStages = shader_stages,
+        .stageCount = 2,
         .pVertexInputState = &vertex_input_create_info,
         .pInputAssemblyState = &input_assembly_create_info,
         .pViewportState = &viewport_state_create_info,
         .pRasterizationState = &rasterizer_create_info,
         .pMultisampleState = &multisampling_create_info,
+        .pDepthStencilState = &depth_stencil_create_info,
         .pColorBlendState = &color_blend_create_info,
         .pDynamicState = &dynamic_state_create_info,
-        .layout = pipeline_layout,
-        .renderPass = render_pass,
+        .layout = ctx.pipeline_layout,
+        .renderPass = ctx.render_pass,
         .subpass = 0,
     };
 
-    VkResult result = vkCreateGraphicsPipelines(logical_device, VK_NULL_HANDLE, 1, &pipeline_create_info, NULL, &pipeline);
+    return VK_CHECK(vkCreateGraphicsPipelines(ctx.logical_device, ctx.pipeline_cache, 1, &pipeline_create_info, VK_ALLOCATOR, pipeline));
+}
+
+VkResult create_graphics_pipeline() {
+    VkResult result = load_shader_modules(&ctx.vertex_shader, &ctx.fragment_shader);
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_SHADER_MODULE, ctx.vertex_shader);
+    TRACK(RESOURCE_SHADER_MODULE, ctx.fragment_shader);
+
+    result = create_pipeline_layout();
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    struct pipeline_state state = generic_pipeline_state();
+    result = compile_pipeline(&state, &ctx.pipeline);
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    TRACK(RESOURCE_PIPELINE, ctx.pipeline);
+    DEBUG_NAME(VK_OBJECT_TYPE_PIPELINE, ctx.pipeline, "Triangle pipeline");
+    return result;
+}
+
+uint64_t hash_pipeline_state(const struct pipeline_state* state) {
+    const uint32_t fields[5] = {
+        (uint32_t)state->cull_mode,
+        (uint32_t)state->topology,
+        (uint32_t)state->samples,
+        (uint32_t)state->blend,
+        state->features,
+    };
+
+    // FNV-1a over the fields, not the struct, so padding never reaches the hash.
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t i = 0; i < 5; i++) {
+        for (uint32_t byte = 0; byte < 4; byte++) {
+            hash ^= (fields[i] >> (byte * 8)) & 0xff;
+            hash *= 1099511628211ull;
+        }
+    }
+
+    return hash;
+}
+
+bool pipeline_states_equal(const struct pipeline_state* a, const struct pipeline_state* b) {
+    return a->cull_mode == b->cull_mode && a->topology == b->topology && a->samples == b->samples &&
+        a->blend == b->blend && a->features == b->features;
+}
+
+// Open addressing keyed on the state hash. Call with the registry locked.
+struct pipeline_variant* find_pipeline_variant(const struct pipeline_state* state, bool insert) {
+    struct pipeline_registry* registry = &ctx.pipelines;
+    uint64_t hash = hash_pipeline_state(state);
+    for (uint32_t probe = 0; probe < MAX_PIPELINE_VARIANTS; probe++) {
+        struct pipeline_variant* variant = &registry->variants[(hash + probe) % MAX_PIPELINE_VARIANTS];
+        if (variant->state == PIPELINE_VARIANT_EMPTY) {
+            if (!insert) {
+                return NULL;
+            }
+
+            variant->hash = hash;
+            variant->key = *state;
+            variant->state = PIPELINE_VARIANT_QUEUED;
+            registry->count++;
+            registry->pending++;
+            pthread_cond_signal(&registry->wake);
+            return variant;
+        }
+
+        if (variant->hash == hash && pipeline_states_equal(&variant->key, state)) {
+            return variant;
+        }
+    }
+
+    return NULL;
+}
+
+void* pipeline_worker(void* data) {
+    struct pipeline_registry* registry = data;
+    pthread_mutex_lock(&registry->lock);
+    while (!registry->stop) {
+        struct pipeline_variant* next = NULL;
+        for (uint32_t i = 0; i < MAX_PIPELINE_VARIANTS && !registry->paused && next == NULL; i++) {
+            if (registry->variants[i].state == PIPELINE_VARIANT_QUEUED) {
+                next = &registry->variants[i];
+            }
+        }
+
+        if (next == NULL) {
+            pthread_cond_wait(&registry->wake, &registry->lock);
+            continue;
+        }
+
+        next->state = PIPELINE_VARIANT_COMPILING;
+        struct pipeline_state key = next->key;
+        pthread_mutex_unlock(&registry->lock);
+
+        double start = now_seconds();
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        VkResult result = compile_pipeline(&key, &pipeline);
+        double seconds = now_seconds() - start;
+
+        pthread_mutex_lock(&registry->lock);
+        next->pipeline = pipeline;
+        next->compile_seconds = seconds;
+        next->state = result == VK_SUCCESS ? PIPELINE_VARIANT_COMPILED : PIPELINE_VARIANT_FAILED;
+        registry->pending--;
+        pthread_cond_broadcast(&registry->done);
+        if (!ctx.headless) {
+            glfwPostEmptyEvent();
+        }
+    }
+    pthread_mutex_unlock(&registry->lock);
+
+    return NULL;
+}
+
+// Handle pools are main-thread only, so finished variants are tracked here
+// rather than by the worker that compiled them.
+void update_pipeline_variants() {
+    struct pipeline_registry* registry = &ctx.pipelines;
+    if (registry->threads_count == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&registry->lock);
+    for (uint32_t i = 0; i < MAX_PIPELINE_VARIANTS; i++) {
+        struct pipeline_variant* variant = &registry->variants[i];
+        if (variant->state != PIPELINE_VARIANT_COMPILED) {
+            continue;
+        }
+
+        TRACK(RESOURCE_PIPELINE, variant->pipeline);
+        DEBUG_NAME(VK_OBJECT_TYPE_PIPELINE, variant->pipeline, "Pipeline variant");
+        variant->state = PIPELINE_VARIANT_READY;
+        registry->compiled++;
+        registry->compile_seconds += variant->compile_seconds;
+        ctx.pacing.dirty = true;
+    }
+    pthread_mutex_unlock(&registry->lock);
+}
+
+// Returns the variant for a state once it has compiled, queueing it on first
+// use; until then the generic pipeline draws in its place.
+VkPipeline request_pipeline(const struct pipeline_state* state) {
+    struct pipeline_registry* registry = &ctx.pipelines;
+    if (registry->threads_count == 0) {
+        return ctx.pipeline;
+    }
+
+    pthread_mutex_lock(&registry->lock);
+    struct pipeline_variant* variant = find_pipeline_variant(state, true);
+    VkPipeline pipeline = variant != NULL && variant->state == PIPELINE_VARIANT_READY ? variant->pipeline : VK_NULL_HANDLE;
+    pthread_mutex_unlock(&registry->lock);
+
+    if (pipeline == VK_NULL_HANDLE) {
+        registry->fallback_binds++;
+        return ctx.pipeline;
+    }
+
+    return pipeline;
+}
+
+// Groups on texture 0, the white texture, get a variant that skips sampling.
+struct pipeline_state draw_pipeline_state(uint32_t texture) {
+    struct pipeline_state state = ctx.pipeline_state;
+    if (texture != 0) {
+        state.features |= PIPELINE_FEATURE_TEXTURE;
+    } else {
+        state.features &= ~PIPELINE_FEATURE_TEXTURE;
+    }
+
+    return state;
+}
+
+void request_default_pipelines() {
+    for (uint32_t texture = 0; texture < 2; texture++) {
+        struct pipeline_state state = draw_pipeline_state(texture);
+        request_pipeline(&state);
+    }
+}
+
+void wait_for_pipeline_variants() {
+    struct pipeline_registry* registry = &ctx.pipelines;
+    if (registry->threads_count == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&registry->lock);
+    while (registry->pending > 0) {
+        pthread_cond_wait(&registry->done, &registry->lock);
+    }
+    pthread_mutex_unlock(&registry->lock);
+    update_pipeline_variants();
+}
+
+// Stops workers picking up variants and waits out those mid-compile, so the
+// shader modules and render pass can be swapped underneath them.
+void pause_pipeline_workers() {
+    struct pipeline_registry* registry = &ctx.pipelines;
+    if (registry->threads_count == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&registry->lock);
+    registry->paused = true;
+    for (;;) {
+        bool compiling = false;
+        for (uint32_t i = 0; i < MAX_PIPELINE_VARIANTS; i++) {
+            compiling = compiling || registry->variants[i].state == PIPELINE_VARIANT_COMPILING;
+        }
+
+        if (!compiling) {
+            break;
+        }
+        pthread_cond_wait(&registry->done, &registry->lock);
+    }
+    pthread_mutex_unlock(&registry->lock);
+    update_pipeline_variants();
+}
+
+// Retires every variant built from the old shaders and queues it again.
+void resume_pipeline_workers(bool recompile) {
+    struct pipeline_registry* registry = &ctx.pipelines;
+    if (registry->threads_count == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&registry->lock);
+    for (uint32_t i = 0; i < MAX_PIPELINE_VARIANTS && recompile; i++) {
+        struct pipeline_variant* variant = &registry->variants[i];
+        if (variant->state != PIPELINE_VARIANT_READY && variant->state != PIPELINE_VARIANT_FAILED) {
+            continue;
+        }
+
+        DEFER_DESTROY(RESOURCE_PIPELINE, variant->pipeline);
+        variant->pipeline = VK_NULL_HANDLE;
+        variant->state = PIPELINE_VARIANT_QUEUED;
+        registry->pending++;
+    }
+
+    registry->paused = false;
+    pthread_cond_broadcast(&registry->wake);
+    pthread_mutex_unlock(&registry->lock);
+}
+
+void start_pipeline_workers() {
+    struct pipeline_registry* registry = &ctx.pipelines;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t workers = cpus > 0 ? (uint32_t)cpus : 1;
+    workers = workers < MAX_PIPELINE_WORKERS ? workers : MAX_PIPELINE_WORKERS;
+
+    pthread_mutex_init(&registry->lock, NULL);
+    pthread_cond_init(&registry->wake, NULL);
+    pthread_cond_init(&registry->done, NULL);
+    for (uint32_t i = 0; i < workers; i++) {
+        if (pthread_create(&registry->threads[registry->threads_count], NULL, pipeline_worker, registry) != 0) {
+            break;
+        }
+        registry->threads_count++;
+    }
+
+    if (registry->threads_count == 0) {
+        puts("Failed to start pipeline workers, drawing with the generic pipeline");
+        pthread_mutex_destroy(&registry->lock);
+        pthread_cond_destroy(&registry->wake);
+        pthread_cond_destroy(&registry->done);
+    }
+}
+
+void stop_pipeline_workers() {
+    struct pipeline_registry* registry = &ctx.pipelines;
+    if (registry->threads_count == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&registry->lock);
+    registry->stop = true;
+    pthread_cond_broadcast(&registry->wake);
+    pthread_mutex_unlock(&registry->lock);
+    for (uint32_t i = 0; i < registry->threads_count; i++) {
+        pthread_join(registry->threads[i], NULL);
+    }
+
+    // Anything still untracked never reached a frame.
+    for (uint32_t i = 0; i < MAX_PIPELINE_VARIANTS; i++) {
+        if (registry->variants[i].state == PIPELINE_VARIANT_COMPILED) {
+            vkDestroyPipeline(ctx.logical_device, registry->variants[i].pipeline, VK_ALLOCATOR);
+        }
+    }
+
+    pthread_mutex_destroy(&registry->lock);
+    pthread_cond_destroy(&registry->wake);
+    pthread_cond_destroy(&registry->done);
+    registry->threads_count = 0;
+}
+
+void print_pipeline_stats() {
+    struct pipeline_registry* registry = &ctx.pipelines;
+    printf("pipelines: %u variants, %llu compiled, %.2f ms average compile, %llu fallback binds\n",
+        registry->count, (unsigned long long)registry->compiled,
+        registry->compiled > 0 ? registry->compile_seconds * 1e3 / registry->compiled : 0.0,
+        (unsigned long long)registry->fallback_binds);
+}
+
+// Lays out a frame buffer's views to match the render pass: the colour image
+// is attachment 0, or the resolve target behind the multisampled pair.
+uint32_t frame_buffer_attachments(struct output* output, VkImageView color, VkImageView attachments[3]) {
+    if (ctx.samples == VK_SAMPLE_COUNT_1_BIT) {
+        attachments[0] = color;
+        attachments[1] = output->depth_target.view;
+        return 2;
+    }
+
+    attachments[0] = output->color_target.view;
+    attachments[1] = output->depth_target.view;
+    attachments[2] = color;
+    return 3;
+}
+
+VkResult create_frame_buffer(struct output* output) {
+    struct swap_chain* swap_chain = &output->swap_chain;
+    swap_chain->frame_buffers = host_calloc(swap_chain->images_count, sizeof(VkFramebuffer));
+
+    for (uint32_t i = 0; i < swap_chain->images_count; i++) {
+        VkImageView attachments[3];
+
+        VkFramebufferCreateInfo create_info = {
+            .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+            .renderPass = ctx.render_pass,
+            .attachmentCount = frame_buffer_attachments(output, swap_chain->image_views[i], attachments),
+            .pAttachments = attachments,
+            .width = swap_chain->extent.width,
+            .height = swap_chain->extent.height,
+            .layers = 1,
+        };
+
+        VkResult result = VK_CHECK(vkCreateFramebuffer(ctx.logical_device, &create_info, VK_ALLOCATOR, &swap_chain->frame_buffers[i]));
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+
+        TRACK(RESOURCE_FRAMEBUFFER, swap_chain->frame_buffers[i]);
+        DEBUG_NAME(VK_OBJECT_TYPE_FRAMEBUFFER, swap_chain->frame_buffers[i], "Swap chain frame buffer");
+    }
+
+    return VK_SUCCESS;
+}
+
+VkResult create_command_pool() {
+    struct queue_family_indices indices = ctx.queue_families;
+    VkCommandPoolCreateInfo create_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+        .queueFamilyIndex = indices.graphics_family.value,
+    };
+
+    VkResult result = VK_CHECK(vkCreateCommandPool(ctx.logical_device, &create_info, VK_ALLOCATOR, &ctx.command_pool));
+    TRACK(RESOURCE_COMMAND_POOL, ctx.command_pool);
+    DEBUG_NAME(VK_OBJECT_TYPE_COMMAND_POOL, ctx.command_pool, "Graphics command pool");
+    return result;
+}
+
+VkResult create_command_buffer() {
+    VkCommandBufferAllocateInfo buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = ctx.command_pool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1
+    };
+
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        VkResult result = VK_CHECK(vkAllocateCommandBuffers(ctx.logical_device, &buffer_info, &ctx.frames[i].command_buffer));
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+
+        DEBUG_NAME(VK_OBJECT_TYPE_COMMAND_BUFFER, ctx.frames[i].command_buffer, "Frame command buffer");
+    }
+
+    return VK_SUCCESS;
+}
+
+bool find_memory_type(uint32_t type_bits, VkMemoryPropertyFlags properties, uint32_t* index) {
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    vkGetPhysicalDeviceMemoryProperties(ctx.physical_device, &memory_properties);
+
+    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++) {
+        if (!(type_bits & (1u << i))) {
+            continue;
+        }
+
+        if ((memory_properties.memoryTypes[i].propertyFlags & properties) != properties) {
+            continue;
+        }
+
+        *index = i;
+        return true;
+    }
+
+    return false;
+}
+
+// Attachments that only live inside the render pass. Each output has one set
+// shared by its frames and offscreen targets; they follow the output's extent
+// and are retired alongside its swap chain.
+VkResult create_attachment_image(struct output* output, VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspect,
+        struct texture_image* target) {
+    VkImageCreateInfo image_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .imageType = VK_IMAGE_TYPE_2D,
+        .format = format,
+        .extent.width = output->swap_chain.extent.width,
+        .extent.height = output->swap_chain.extent.height,
+        .extent.depth = 1,
+        .mipLevels = 1,
+        .arrayLayers = 1,
+        .samples = ctx.samples,
+        .tiling = VK_IMAGE_TILING_OPTIMAL,
+        .usage = usage | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+
+    VkResult result = VK_CHECK(vkCreateImage(ctx.logical_device, &image_info, VK_ALLOCATOR, &target->image));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_IMAGE, target->image);
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(ctx.logical_device, target->image, &requirements);
+
+    VkMemoryAllocateInfo allocate_info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = requirements.size,
+    };
+
+    // Tilers can keep transient attachments on chip and never back them.
+    if (!find_memory_type(requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT,
+            &allocate_info.memoryTypeIndex) &&
+        !find_memory_type(requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &allocate_info.memoryTypeIndex)) {
+        return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    }
+
+    result = VK_CHECK(vkAllocateMemory(ctx.logical_device, &allocate_info, VK_ALLOCATOR, &target->memory));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_DEVICE_MEMORY, target->memory);
+    target->size = requirements.size;
+
+    result = VK_CHECK(vkBindImageMemory(ctx.logical_device, target->image, target->memory, 0));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    VkImageViewCreateInfo view_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = target->image,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = format,
+        .subresourceRange.aspectMask = aspect,
+        .subresourceRange.baseMipLevel = 0,
+        .subresourceRange.levelCount = 1,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.layerCount = 1
+    };
+
+    result = VK_CHECK(vkCreateImageView(ctx.logical_device, &view_info, VK_ALLOCATOR, &target->view));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_IMAGE_VIEW, target->view);
+
+    return VK_SUCCESS;
+}
+
+VkResult create_attachment_targets(struct output* output) {
+    VkImageAspectFlags aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+    if (depth_format_has_stencil(ctx.depth_format)) {
+        aspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+    }
+
+    VkResult result = create_attachment_image(output, ctx.depth_format, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, aspect,
+        &output->depth_target);
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    DEBUG_NAME(VK_OBJECT_TYPE_IMAGE, output->depth_target.image, "Depth target image");
+    DEBUG_NAME(VK_OBJECT_TYPE_DEVICE_MEMORY, output->depth_target.memory, "Depth target memory");
+    DEBUG_NAME(VK_OBJECT_TYPE_IMAGE_VIEW, output->depth_target.view, "Depth target image view");
+
+    if (ctx.samples == VK_SAMPLE_COUNT_1_BIT) {
+        return VK_SUCCESS;
+    }
+
+    result = create_attachment_image(output, ctx.color_format, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VK_IMAGE_ASPECT_COLOR_BIT,
+        &output->color_target);
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    DEBUG_NAME(VK_OBJECT_TYPE_IMAGE, output->color_target.image, "Multisampled colour image");
+    DEBUG_NAME(VK_OBJECT_TYPE_DEVICE_MEMORY, output->color_target.memory, "Multisampled colour memory");
+    DEBUG_NAME(VK_OBJECT_TYPE_IMAGE_VIEW, output->color_target.view, "Multisampled colour image view");
+
+    return VK_SUCCESS;
+}
+
+VkResult create_offscreen_target(struct output* output, struct offscreen_target* target) {
+    VkImageCreateInfo image_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .imageType = VK_IMAGE_TYPE_2D,
+        .format = output->swap_chain.format,
+        .extent.width = output->swap_chain.extent.width,
+        .extent.height = output->swap_chain.extent.height,
+        .extent.depth = 1,
+        .mipLevels = 1,
+        .arrayLayers = 1,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .tiling = VK_IMAGE_TILING_OPTIMAL,
+        .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+
+    VkResult result = VK_CHECK(vkCreateImage(ctx.logical_device, &image_info, VK_ALLOCATOR, &target->image));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_IMAGE, target->image);
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(ctx.logical_device, target->image, &requirements);
+
+    VkMemoryAllocateInfo allocate_info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = requirements.size,
+    };
+
+    if (!find_memory_type(requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &allocate_info.memoryTypeIndex)) {
+        return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    }
+
+    result = VK_CHECK(vkAllocateMemory(ctx.logical_device, &allocate_info, VK_ALLOCATOR, &target->memory));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_DEVICE_MEMORY, target->memory);
+
+    result = VK_CHECK(vkBindImageMemory(ctx.logical_device, target->image, target->memory, 0));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    VkImageViewCreateInfo view_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = target->image,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = output->swap_chain.format,
+        .components.r = VK_COMPONENT_SWIZZLE_IDENTITY,
+        .components.g = VK_COMPONENT_SWIZZLE_IDENTITY,
+        .components.b = VK_COMPONENT_SWIZZLE_IDENTITY,
+        .components.a = VK_COMPONENT_SWIZZLE_IDENTITY,
+        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.baseMipLevel = 0,
+        .subresourceRange.levelCount = 1,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.layerCount = 1
+    };
+
+    result = VK_CHECK(vkCreateImageView(ctx.logical_device, &view_info, VK_ALLOCATOR, &target->image_view));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_IMAGE_VIEW, target->image_view);
+
+    VkImageView attachments[3];
+    VkFramebufferCreateInfo frame_buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+        .renderPass = ctx.render_pass,
+        .attachmentCount = frame_buffer_attachments(output, target->image_view, attachments),
+        .pAttachments = attachments,
+        .width = output->swap_chain.extent.width,
+        .height = output->swap_chain.extent.height,
+        .layers = 1,
+    };
+
+    result = VK_CHECK(vkCreateFramebuffer(ctx.logical_device, &frame_buffer_info, VK_ALLOCATOR, &target->frame_buffer));
+    TRACK(RESOURCE_FRAMEBUFFER, target->frame_buffer);
+
+    DEBUG_NAME(VK_OBJECT_TYPE_IMAGE, target->image, "Offscreen target image");
+    DEBUG_NAME(VK_OBJECT_TYPE_DEVICE_MEMORY, target->memory, "Offscreen target memory");
+    DEBUG_NAME(VK_OBJECT_TYPE_IMAGE_VIEW, target->image_view, "Offscreen target image view");
+    DEBUG_NAME(VK_OBJECT_TYPE_FRAMEBUFFER, target->frame_buffer, "Offscreen target frame buffer");
+
+    return result;
+}
+
+void retire_offscreen_targets() {
+    for (uint32_t i = 0; i < ctx.offscreen_targets_count; i++) {
+        struct offscreen_target* target = &ctx.offscreen_targets[i];
+        DEFER_DESTROY(RESOURCE_FRAMEBUFFER, target->frame_buffer);
+        DEFER_DESTROY(RESOURCE_IMAGE_VIEW, target->image_view);
+        DEFER_DESTROY(RESOURCE_IMAGE, target->image);
+        DEFER_DESTROY(RESOURCE_DEVICE_MEMORY, target->memory);
+    }
+
+    host_free(ctx.offscreen_targets);
+    ctx.offscreen_targets = NULL;
+    ctx.offscreen_targets_count = 0;
+}
+
+VkResult create_offscreen_targets(uint32_t count) {
+    ctx.offscreen_targets = host_calloc(count, sizeof(struct offscreen_target));
+    ctx.offscreen_targets_count = count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        // Handles of the failed target that were never created are still zero,
+        // so retiring the whole array also releases its partial state.
+        VkResult result = create_offscreen_target(&ctx.outputs[0], &ctx.offscreen_targets[i]);
+        if (result != VK_SUCCESS) {
+            retire_offscreen_targets();
+            return result;
+        }
+    }
+
+    return VK_SUCCESS;
+}
+
+uint32_t mip_levels(uint32_t width, uint32_t height) {
+    uint32_t size = width > height ? width : height;
+    uint32_t levels = 1;
+    while (size > 1) {
+        size >>= 1;
+        levels++;
+    }
+
+    return levels;
+}
+
+bool read_ppm_value(FILE* file, uint32_t* value) {
+    int c = fgetc(file);
+    while (c == '#' || isspace(c)) {
+        if (c == '#') {
+            while (c != '\n' && c != EOF) {
+                c = fgetc(file);
+            }
+        }
+
+        c = fgetc(file);
+    }
+
+    unsigned int parsed = 0;
+    if (c == EOF || ungetc(c, file) == EOF || fscanf(file, "%u", &parsed) != 1) {
+        return false;
+    }
+
+    *value = parsed;
+    return true;
+}
+
+uint8_t* decode_ppm(const char* path, uint32_t* width, uint32_t* height) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Failed to open %s\n", path);
+        return NULL;
+    }
+
+    uint32_t max_value = 0;
+    bool valid = fgetc(file) == 'P' && fgetc(file) == '6' &&
+        read_ppm_value(file, width) && read_ppm_value(file, height) && read_ppm_value(file, &max_value) &&
+        max_value == 255 && *width > 0 && *height > 0 && *width <= MAX_TEXTURE_SIZE && *height <= MAX_TEXTURE_SIZE &&
+        isspace(fgetc(file));
+
+    size_t count = (size_t)*width * *height;
+    uint8_t* pixels = valid ? host_alloc(count * 4) : NULL;
+    if (pixels == NULL || fread(pixels + count, 3, count, file) != count) {
+        printf("Failed to decode %s, expected a binary 8-bit PPM\n", path);
+        host_free(pixels);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t r = pixels[count + i * 3];
+        uint8_t g = pixels[count + i * 3 + 1];
+        uint8_t b = pixels[count + i * 3 + 2];
+        pixels[i * 4] = r;
+        pixels[i * 4 + 1] = g;
+        pixels[i * 4 + 2] = b;
+        pixels[i * 4 + 3] = 255;
+    }
+
+    return pixels;
+}
+
+void downsample_rgba(uint8_t* pixels, uint32_t* width, uint32_t* height) {
+    uint32_t source_width = *width;
+    uint32_t source_height = *height;
+    uint32_t target_width = source_width > 1 ? source_width / 2 : 1;
+    uint32_t target_height = source_height > 1 ? source_height / 2 : 1;
+
+    for (uint32_t y = 0; y < target_height; y++) {
+        uint32_t y0 = y * 2 < source_height ? y * 2 : source_height - 1;
+        uint32_t y1 = y * 2 + 1 < source_height ? y * 2 + 1 : y0;
+        for (uint32_t x = 0; x < target_width; x++) {
+            uint32_t x0 = x * 2 < source_width ? x * 2 : source_width - 1;
+            uint32_t x1 = x * 2 + 1 < source_width ? x * 2 + 1 : x0;
+
+            uint32_t sum[4] = {0};
+            for (uint32_t c = 0; c < 4; c++) {
+                sum[c] = pixels[((size_t)y0 * source_width + x0) * 4 + c] + pixels[((size_t)y0 * source_width + x1) * 4 + c] +
+                    pixels[((size_t)y1 * source_width + x0) * 4 + c] + pixels[((size_t)y1 * source_width + x1) * 4 + c];
+            }
+
+            for (uint32_t c = 0; c < 4; c++) {
+                pixels[((size_t)y * target_width + x) * 4 + c] = (uint8_t)((sum[c] + 2) / 4);
+            }
+        }
+    }
+
+    *width = target_width;
+    *height = target_height;
+}
+
+void image_barrier(VkCommandBuffer buffer, VkImage image, uint32_t base_level, uint32_t level_count,
+        VkImageLayout old_layout, VkImageLayout new_layout, VkAccessFlags src_access, VkAccessFlags dst_access,
+        VkPipelineStageFlags src_stage, VkPipelineStageFlags dst_stage, uint32_t src_family, uint32_t dst_family) {
+    VkImageMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = src_access,
+        .dstAccessMask = dst_access,
+        .oldLayout = old_layout,
+        .newLayout = new_layout,
+        .srcQueueFamilyIndex = src_family,
+        .dstQueueFamilyIndex = dst_family,
+        .image = image,
+        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.baseMipLevel = base_level,
+        .subresourceRange.levelCount = level_count,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.layerCount = 1,
+    };
+
+    vkCmdPipelineBarrier(buffer, src_stage, dst_stage, 0, 0, NULL, 0, NULL, 1, &barrier);
+}
+
+void destroy_texture_image(struct texture_image* image) {
+    vkDestroyImageView(ctx.logical_device, image->view, VK_ALLOCATOR);
+    vkDestroyImage(ctx.logical_device, image->image, VK_ALLOCATOR);
+    vkFreeMemory(ctx.logical_device, image->memory, VK_ALLOCATOR);
+    memset(image, 0, sizeof(struct texture_image));
+}
+
+void retire_texture_image(struct texture_image* image) {
+    DEFER_DESTROY(RESOURCE_IMAGE_VIEW, image->view);
+    DEFER_DESTROY(RESOURCE_IMAGE, image->image);
+    DEFER_DESTROY(RESOURCE_DEVICE_MEMORY, image->memory);
+    memset(image, 0, sizeof(struct texture_image));
+}
+
+void retire_attachment_targets(struct output* output) {
+    retire_texture_image(&output->depth_target);
+    if (output->color_target.image != VK_NULL_HANDLE) {
+        retire_texture_image(&output->color_target);
+    }
+}
+
+void track_texture_image(struct texture_image* image, const char* name) {
+    TRACK(RESOURCE_IMAGE, image->image);
+    TRACK(RESOURCE_DEVICE_MEMORY, image->memory);
+    TRACK(RESOURCE_IMAGE_VIEW, image->view);
+    DEBUG_NAME(VK_OBJECT_TYPE_IMAGE, image->image, name);
+    DEBUG_NAME(VK_OBJECT_TYPE_IMAGE_VIEW, image->view, name);
+    (void)name;
+}
+
+VkResult create_texture_image(uint32_t width, uint32_t height, uint32_t levels, VkImageUsageFlags usage, struct texture_image* out) {
+    VkImageCreateInfo image_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .imageType = VK_IMAGE_TYPE_2D,
+        .format = TEXTURE_FORMAT,
+        .extent.width = width,
+        .extent.height = height,
+        .extent.depth = 1,
+        .mipLevels = levels,
+        .arrayLayers = 1,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .tiling = VK_IMAGE_TILING_OPTIMAL,
+        .usage = usage | VK_IMAGE_USAGE_SAMPLED_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+
+    VkResult result = VK_CHECK(vkCreateImage(ctx.logical_device, &image_info, VK_ALLOCATOR, &out->image));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(ctx.logical_device, out->image, &requirements);
+
+    VkMemoryAllocateInfo allocate_info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = requirements.size,
+    };
+
+    if (!find_memory_type(requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &allocate_info.memoryTypeIndex)) {
+        return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    }
+
+    result = VK_CHECK(vkAllocateMemory(ctx.logical_device, &allocate_info, VK_ALLOCATOR, &out->memory));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    out->size = requirements.size;
+
+    result = VK_CHECK(vkBindImageMemory(ctx.logical_device, out->image, out->memory, 0));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    VkImageViewCreateInfo view_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = out->image,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = TEXTURE_FORMAT,
+        .components.r = VK_COMPONENT_SWIZZLE_IDENTITY,
+        .components.g = VK_COMPONENT_SWIZZLE_IDENTITY,
+        .components.b = VK_COMPONENT_SWIZZLE_IDENTITY,
+        .components.a = VK_COMPONENT_SWIZZLE_IDENTITY,
+        .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.baseMipLevel = 0,
+        .subresourceRange.levelCount = levels,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.layerCount = 1,
+    };
+
+    return VK_CHECK(vkCreateImageView(ctx.logical_device, &view_info, VK_ALLOCATOR, &out->view));
+}
+
+void destroy_texture_job(struct texture_job* job) {
+    vkDestroyBuffer(ctx.logical_device, job->staging, VK_ALLOCATOR);
+    vkFreeMemory(ctx.logical_device, job->staging_memory, VK_ALLOCATOR);
+    vkDestroySemaphore(ctx.logical_device, job->uploaded, VK_ALLOCATOR);
+    job->staging = VK_NULL_HANDLE;
+    job->staging_memory = VK_NULL_HANDLE;
+    job->uploaded = VK_NULL_HANDLE;
+}
+
+VkResult upload_texture_job(struct texture_job* job, uint8_t* pixels) {
+    VkDeviceSize size = (VkDeviceSize)job->width * job->height * 4;
+    VkBufferCreateInfo buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = size,
+        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+
+    VkResult result = VK_CHECK(vkCreateBuffer(ctx.logical_device, &buffer_info, VK_ALLOCATOR, &job->staging));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(ctx.logical_device, job->staging, &requirements);
+
+    VkMemoryAllocateInfo allocate_info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = requirements.size,
+    };
+
+    VkMemoryPropertyFlags host_visible = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    if (!find_memory_type(requirements.memoryTypeBits, host_visible, &allocate_info.memoryTypeIndex)) {
+        return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    }
+
+    result = VK_CHECK(vkAllocateMemory(ctx.logical_device, &allocate_info, VK_ALLOCATOR, &job->staging_memory));
+    if (result == VK_SUCCESS) {
+        result = VK_CHECK(vkBindBufferMemory(ctx.logical_device, job->staging, job->staging_memory, 0));
+    }
+
+    void* data = NULL;
+    if (result == VK_SUCCESS) {
+        result = VK_CHECK(vkMapMemory(ctx.logical_device, job->staging_memory, 0, size, 0, &data));
+    }
+
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    memcpy(data, pixels, size);
+    vkUnmapMemory(ctx.logical_device, job->staging_memory);
+
+    VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    result = create_texture_image(job->width, job->height, job->levels, usage, &job->image);
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    VkSemaphoreCreateInfo semaphore_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    };
+
+    result = VK_CHECK(vkCreateSemaphore(ctx.logical_device, &semaphore_info, VK_ALLOCATOR, &job->uploaded));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    VkCommandBufferAllocateInfo command_buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = ctx.streaming.command_pool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+
+    result = VK_CHECK(vkAllocateCommandBuffers(ctx.logical_device, &command_buffer_info, &job->command_buffer));
+    if (result != VK_SUCCESS) {
+        job->command_buffer = VK_NULL_HANDLE;
+        return result;
+    }
+
+    VkCommandBufferBeginInfo begin_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+
+    VkCommandBuffer buffer = job->command_buffer;
+    VK_CHECK(vkBeginCommandBuffer(buffer, &begin_info));
+    image_barrier(buffer, job->image.image, 0, 1, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+
+    VkBufferImageCopy region = {
+        .bufferOffset = 0,
+        .imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .imageSubresource.mipLevel = 0,
+        .imageSubresource.baseArrayLayer = 0,
+        .imageSubresource.layerCount = 1,
+        .imageExtent.width = job->width,
+        .imageExtent.height = job->height,
+        .imageExtent.depth = 1,
+    };
+    vkCmdCopyBufferToImage(buffer, job->staging, job->image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    uint32_t transfer_family = ctx.queue_families.transfer_family.value;
+    uint32_t graphics_family = ctx.queue_families.graphics_family.value;
+    if (transfer_family != graphics_family) {
+        image_barrier(buffer, job->image.image, 0, 1, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            VK_ACCESS_TRANSFER_WRITE_BIT, 0, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            transfer_family, graphics_family);
+    }
+
+    result = VK_CHECK(vkEndCommandBuffer(buffer));
+    if (result != VK_SUCCESS || ctx.transfer_queue_shared) {
+        return result;
+    }
+
+    VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &buffer,
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &job->uploaded,
+    };
+
+    result = VK_CHECK(vkQueueSubmit(ctx.transfer_queue, 1, &submit_info, VK_NULL_HANDLE));
+    job->submitted = result == VK_SUCCESS;
+    return result;
+}
+
+// Replays stream from the pixels stored in the mapped capture instead of the
+// source file. The copy is needed because downsampling works in place.
+uint8_t* load_texture_pixels(const struct texture* texture, uint32_t* width, uint32_t* height) {
+    if (texture->captured == NULL) {
+        return decode_ppm(texture->path, width, height);
+    }
+
+    size_t size = (size_t)texture->captured_width * texture->captured_height * 4;
+    uint8_t* pixels = host_alloc(size);
+    if (pixels != NULL) {
+        memcpy(pixels, texture->captured, size);
+        *width = texture->captured_width;
+        *height = texture->captured_height;
+    }
+
+    return pixels;
+}
+
+void load_texture_job(struct texture_job* job) {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint8_t* pixels = load_texture_pixels(&ctx.streaming.textures[job->texture], &width, &height);
+    if (pixels == NULL) {
+        job->failed = true;
+        return;
+    }
+
+    job->source_width = width;
+    job->source_height = height;
+    while (!job->full && (width > STREAM_COARSE_SIZE || height > STREAM_COARSE_SIZE)) {
+        downsample_rgba(pixels, &width, &height);
+    }
+
+    job->width = width;
+    job->height = height;
+    job->levels = mip_levels(width, height);
+
+    VkResult result = upload_texture_job(job, pixels);
+    host_free(pixels);
+    if (result != VK_SUCCESS) {
+        destroy_texture_job(job);
+        destroy_texture_image(&job->image);
+        if (job->command_buffer != VK_NULL_HANDLE) {
+            vkFreeCommandBuffers(ctx.logical_device, ctx.streaming.command_pool, 1, &job->command_buffer);
+            job->command_buffer = VK_NULL_HANDLE;
+        }
+        job->failed = true;
+    }
+}
+
+void* texture_loader(void* data) {
+    struct texture_streaming* streaming = data;
+    pthread_mutex_lock(&streaming->lock);
+    while (!streaming->stop) {
+        struct texture_job* next = NULL;
+        for (uint32_t i = 0; i < MAX_TEXTURE_JOBS; i++) {
+            struct texture_job* job = &streaming->jobs[i];
+            if (job->state == TEXTURE_JOB_RETIRED) {
+                vkFreeCommandBuffers(ctx.logical_device, streaming->command_pool, 1, &job->command_buffer);
+                job->command_buffer = VK_NULL_HANDLE;
+                job->state = TEXTURE_JOB_FREE;
+            } else if (job->state == TEXTURE_JOB_QUEUED && next == NULL) {
+                next = job;
+            }
+        }
+
+        if (next == NULL) {
+            pthread_cond_wait(&streaming->wake, &streaming->lock);
+            continue;
+        }
+
+        next->state = TEXTURE_JOB_LOADING;
+        pthread_mutex_unlock(&streaming->lock);
+        load_texture_job(next);
+        pthread_mutex_lock(&streaming->lock);
+        next->state = TEXTURE_JOB_UPLOADED;
+        if (!ctx.headless) {
+            glfwPostEmptyEvent();
+        }
+    }
+    pthread_mutex_unlock(&streaming->lock);
+
+    return NULL;
+}
+
+bool request_texture(uint32_t index, bool full) {
+    struct texture_streaming* streaming = &ctx.streaming;
+    bool queued = false;
+
+    pthread_mutex_lock(&streaming->lock);
+    for (uint32_t i = 0; i < MAX_TEXTURE_JOBS && !queued; i++) {
+        struct texture_job* job = &streaming->jobs[i];
+        if (job->state != TEXTURE_JOB_FREE) {
+            continue;
+        }
+
+        memset(job, 0, sizeof(struct texture_job));
+        job->texture = index;
+        job->full = full;
+        job->state = TEXTURE_JOB_QUEUED;
+        queued = true;
+    }
+    pthread_cond_signal(&streaming->wake);
+    pthread_mutex_unlock(&streaming->lock);
+
+    return queued;
+}
+
+bool texture_uploads_pending() {
+    struct texture_streaming* streaming = &ctx.streaming;
+    if (!streaming->running) {
+        return false;
+    }
+
+    bool pending = false;
+    pthread_mutex_lock(&streaming->lock);
+    for (uint32_t i = 0; i < MAX_TEXTURE_JOBS && !pending; i++) {
+        pending = streaming->jobs[i].state == TEXTURE_JOB_UPLOADED;
+    }
+    pthread_mutex_unlock(&streaming->lock);
+
+    return pending;
+}
+
+void evict_texture(struct texture* texture) {
+    struct texture_streaming* streaming = &ctx.streaming;
+    streaming->resident -= texture->full.size;
+    streaming->evictions++;
+    streaming->version++;
+    retire_texture_image(&texture->full);
+    texture->state = TEXTURE_COARSE;
+}
+
+// Eviction is per texture, not per mip: a full chain is dropped whole and the
+// texture falls back to its coarse image.
+bool make_texture_room(VkDeviceSize size) {
+    struct texture_streaming* streaming = &ctx.streaming;
+    while (streaming->resident + size > streaming->budget) {
+        struct texture* victim = NULL;
+        for (uint32_t i = 1; i < streaming->textures_count; i++) {
+            struct texture* texture = &streaming->textures[i];
+            if (texture->state != TEXTURE_FULL || texture->coarse_is_full || texture->last_used > ctx.frame_serial) {
+                continue;
+            }
+
+            if (victim == NULL || texture->last_used < victim->last_used) {
+                victim = texture;
+            }
+        }
+
+        if (victim == NULL) {
+            return false;
+        }
+
+        evict_texture(victim);
+    }
+
+    return true;
+}
+
+void request_textures() {
+    struct texture_streaming* streaming = &ctx.streaming;
+    for (uint32_t i = 1; i < streaming->textures_count && streaming->running; i++) {
+        struct texture* texture = &streaming->textures[i];
+        if (texture->state == TEXTURE_EMPTY) {
+            if (request_texture(i, false)) {
+                texture->state = TEXTURE_LOADING_COARSE;
+            }
+            continue;
+        }
+
+        if (texture->state != TEXTURE_COARSE || texture->last_used <= ctx.frame_serial) {
+            continue;
+        }
+
+        VkDeviceSize size = (VkDeviceSize)texture->width * texture->height * 4 * 4 / 3;
+        if (make_texture_room(size) && request_texture(i, true)) {
+            streaming->resident += size;
+            texture->full.size = size;
+            texture->state = TEXTURE_LOADING_FULL;
+        }
+    }
+}
+
+void install_texture_job(struct texture_job* job) {
+    struct texture_streaming* streaming = &ctx.streaming;
+    struct texture* texture = &streaming->textures[job->texture];
+    if (job->failed) {
+        if (job->full) {
+            streaming->resident -= texture->full.size;
+            texture->full.size = 0;
+        }
+        texture->state = job->full ? TEXTURE_COARSE : TEXTURE_FAILED;
+        return;
+    }
+
+    track_texture_image(&job->image, texture->path);
+    if (job->full) {
+        streaming->resident += job->image.size - texture->full.size;
+        texture->full = job->image;
+        texture->state = TEXTURE_FULL;
+    } else {
+        texture->width = job->source_width;
+        texture->height = job->source_height;
+        texture->coarse_is_full = job->width == job->source_width && job->height == job->source_height;
+        texture->coarse = job->image;
+        texture->state = texture->coarse_is_full ? TEXTURE_FULL : TEXTURE_COARSE;
+    }
+
+    streaming->version++;
+}
+
+void update_texture_streaming(struct texture_uploads* uploads) {
+    struct texture_streaming* streaming = &ctx.streaming;
+    uploads->count = 0;
+    if (!streaming->running) {
+        return;
+    }
+
+    bool active = false;
+    pthread_mutex_lock(&streaming->lock);
+    for (uint32_t i = 0; i < MAX_TEXTURE_JOBS; i++) {
+        struct texture_job* job = &streaming->jobs[i];
+        if (job->state == TEXTURE_JOB_IN_FLIGHT && job->serial <= ctx.completed_serial) {
+            destroy_texture_job(job);
+            job->state = job->command_buffer != VK_NULL_HANDLE ? TEXTURE_JOB_RETIRED : TEXTURE_JOB_FREE;
+            pthread_cond_signal(&streaming->wake);
+        } else if (job->state == TEXTURE_JOB_UPLOADED) {
+            job->state = TEXTURE_JOB_IN_FLIGHT;
+            job->serial = ctx.frame_serial + 1;
+            uploads->jobs[uploads->count++] = job;
+        }
+
+        active = active || job->state != TEXTURE_JOB_FREE;
+    }
+    pthread_mutex_unlock(&streaming->lock);
+
+    streaming->busy_frames += active;
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < uploads->count; i++) {
+        struct texture_job* job = uploads->jobs[i];
+        if (!job->failed && !job->submitted) {
+            VkSubmitInfo submit_info = {
+                .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                .commandBufferCount = 1,
+                .pCommandBuffers = &job->command_buffer,
+                .signalSemaphoreCount = 1,
+                .pSignalSemaphores = &job->uploaded,
+            };
+
+            job->submitted = VK_CHECK(vkQueueSubmit(ctx.transfer_queue, 1, &submit_info, VK_NULL_HANDLE)) == VK_SUCCESS;
+            if (!job->submitted) {
+                destroy_texture_image(&job->image);
+                job->failed = true;
+            }
+        }
+
+        install_texture_job(job);
+        if (!job->failed) {
+            uploads->jobs[kept++] = job;
+        }
+    }
+    uploads->count = kept;
+}
+
+void record_texture_uploads(VkCommandBuffer buffer, const struct texture_uploads* uploads) {
+    uint32_t transfer_family = ctx.queue_families.transfer_family.value;
+    uint32_t graphics_family = ctx.queue_families.graphics_family.value;
+    bool acquire = transfer_family != graphics_family;
+
+    for (uint32_t i = 0; i < uploads->count; i++) {
+        struct texture_job* job = uploads->jobs[i];
+        VkImage image = job->image.image;
+        image_barrier(buffer, image, 0, 1, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, acquire ? 0 : VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            acquire ? transfer_family : VK_QUEUE_FAMILY_IGNORED, acquire ? graphics_family : VK_QUEUE_FAMILY_IGNORED);
+
+        int32_t width = job->width;
+        int32_t height = job->height;
+        for (uint32_t level = 1; level < job->levels; level++) {
+            int32_t next_width = width > 1 ? width / 2 : 1;
+            int32_t next_height = height > 1 ? height / 2 : 1;
+            image_barrier(buffer, image, level, 1, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+
+            VkImageBlit blit = {
+                .srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .srcSubresource.mipLevel = level - 1,
+                .srcSubresource.baseArrayLayer = 0,
+                .srcSubresource.layerCount = 1,
+                .srcOffsets[1] = {width, height, 1},
+                .dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .dstSubresource.mipLevel = level,
+                .dstSubresource.baseArrayLayer = 0,
+                .dstSubresource.layerCount = 1,
+                .dstOffsets[1] = {next_width, next_height, 1},
+            };
+            vkCmdBlitImage(buffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                1, &blit, ctx.streaming.blit_filter);
+
+            image_barrier(buffer, image, level, 1, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+            width = next_width;
+            height = next_height;
+        }
+
+        image_barrier(buffer, image, 0, job->levels, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+            VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+    }
+}
+
+void update_frame_descriptors(struct frame* frame) {
+    struct texture_streaming* streaming = &ctx.streaming;
+    if (frame->descriptor_version == streaming->version) {
+        return;
+    }
+
+    VkDescriptorImageInfo image_infos[MAX_TEXTURES];
+    for (uint32_t i = 0; i < MAX_TEXTURES; i++) {
+        struct texture* texture = &streaming->textures[i < streaming->textures_count ? i : 0];
+        VkImageView view = texture->full.view != VK_NULL_HANDLE ? texture->full.view : texture->coarse.view;
+        image_infos[i].sampler = streaming->sampler;
+        image_infos[i].imageView = view != VK_NULL_HANDLE ? view : streaming->textures[0].coarse.view;
+        image_infos[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    }
+
+    VkWriteDescriptorSet write = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = frame->descriptor_set,
+        .dstBinding = 0,
+        .dstArrayElement = 0,
+        .descriptorCount = MAX_TEXTURES,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .pImageInfo = image_infos,
+    };
+
+    vkUpdateDescriptorSets(ctx.logical_device, 1, &write, 0, NULL);
+    frame->descriptor_version = streaming->version;
+}
+
+VkResult create_descriptor_set_layout() {
+    VkDescriptorSetLayoutBinding binding = {
+        .binding = 0,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = MAX_TEXTURES,
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+    };
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 1,
+        .pBindings = &binding,
+    };
+
+    VkResult result = VK_CHECK(vkCreateDescriptorSetLayout(ctx.logical_device, &layout_info, VK_ALLOCATOR, &ctx.descriptor_set_layout));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_DESCRIPTOR_SET_LAYOUT, ctx.descriptor_set_layout);
+    DEBUG_NAME(VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT, ctx.descriptor_set_layout, "Texture set layout");
+
+    return VK_SUCCESS;
+}
+
+VkResult create_white_texture(struct texture* texture) {
+    VkResult result = create_texture_image(1, 1, 1, VK_IMAGE_USAGE_TRANSFER_DST_BIT, &texture->coarse);
+    if (result != VK_SUCCESS) {
+        destroy_texture_image(&texture->coarse);
+        return result;
+    }
+    track_texture_image(&texture->coarse, "White texture");
+    texture->path = "white";
+    texture->width = 1;
+    texture->height = 1;
+    texture->coarse_is_full = true;
+    texture->state = TEXTURE_FULL;
+
+    VkCommandBufferAllocateInfo buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = ctx.command_pool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+
+    VkCommandBuffer buffer;
+    result = VK_CHECK(vkAllocateCommandBuffers(ctx.logical_device, &buffer_info, &buffer));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    VkCommandBufferBeginInfo begin_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+
+    VkClearColorValue white = {{1.f, 1.f, 1.f, 1.f}};
+    VkImageSubresourceRange range = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel = 0,
+        .levelCount = 1,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+    };
+
+    VK_CHECK(vkBeginCommandBuffer(buffer, &begin_info));
+    image_barrier(buffer, texture->coarse.image, 0, 1, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+    vkCmdClearColorImage(buffer, texture->coarse.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &white, 1, &range);
+    image_barrier(buffer, texture->coarse.image, 0, 1, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+    result = VK_CHECK(vkEndCommandBuffer(buffer));
+
+    VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &buffer,
+    };
+
+    if (result == VK_SUCCESS) {
+        result = VK_CHECK(vkQueueSubmit(ctx.graphics_queue, 1, &submit_info, VK_NULL_HANDLE));
+    }
+
+    if (result == VK_SUCCESS) {
+        result = VK_CHECK(vkQueueWaitIdle(ctx.graphics_queue));
+    }
+
+    vkFreeCommandBuffers(ctx.logical_device, ctx.command_pool, 1, &buffer);
+    return result;
+}
+
+VkResult create_texture_streaming() {
+    struct texture_streaming* streaming = &ctx.streaming;
+    streaming->version = 1;
+
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(ctx.physical_device, TEXTURE_FORMAT, &format_properties);
+    VkFormatFeatureFlags blit = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+    bool can_blit = (format_properties.optimalTilingFeatures & blit) == blit;
+    bool linear = (format_properties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT) != 0;
+    streaming->blit_filter = linear ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+
+    VkSamplerCreateInfo sampler_info = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter = streaming->blit_filter,
+        .minFilter = streaming->blit_filter,
+        .mipmapMode = linear ? VK_SAMPLER_MIPMAP_MODE_LINEAR : VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .minLod = 0.f,
+        .maxLod = VK_LOD_CLAMP_NONE,
+    };
+
+    VkResult result = VK_CHECK(vkCreateSampler(ctx.logical_device, &sampler_info, VK_ALLOCATOR, &streaming->sampler));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_SAMPLER, streaming->sampler);
+
+    VkDescriptorPoolSize pool_size = {
+        .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = MAX_TEXTURES * MAX_FRAMES_IN_FLIGHT,
+    };
+
+    VkDescriptorPoolCreateInfo pool_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = MAX_FRAMES_IN_FLIGHT,
+        .poolSizeCount = 1,
+        .pPoolSizes = &pool_size,
+    };
+
+    result = VK_CHECK(vkCreateDescriptorPool(ctx.logical_device, &pool_info, VK_ALLOCATOR, &ctx.descriptor_pool));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_DESCRIPTOR_POOL, ctx.descriptor_pool);
+
+    VkDescriptorSetLayout layouts[MAX_FRAMES_IN_FLIGHT];
+    VkDescriptorSet sets[MAX_FRAMES_IN_FLIGHT];
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        layouts[i] = ctx.descriptor_set_layout;
+    }
+
+    VkDescriptorSetAllocateInfo set_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = ctx.descriptor_pool,
+        .descriptorSetCount = MAX_FRAMES_IN_FLIGHT,
+        .pSetLayouts = layouts,
+    };
+
+    result = VK_CHECK(vkAllocateDescriptorSets(ctx.logical_device, &set_info, sets));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        ctx.frames[i].descriptor_set = sets[i];
+        DEBUG_NAME(VK_OBJECT_TYPE_DESCRIPTOR_SET, sets[i], "Frame texture set");
+    }
+
+    result = create_white_texture(&streaming->textures[0]);
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    // Headless replays stream too, so they start from the same resident set as windowed ones.
+    if (streaming->textures_count <= 1 || (ctx.headless && ctx.replay.data == NULL)) {
+        return VK_SUCCESS;
+    }
+
+    if (!can_blit) {
+        puts("Texture format does not support blits, streaming disabled");
+        return VK_SUCCESS;
+    }
+
+    VkCommandPoolCreateInfo command_pool_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = ctx.queue_families.transfer_family.value,
+    };
+
+    result = VK_CHECK(vkCreateCommandPool(ctx.logical_device, &command_pool_info, VK_ALLOCATOR, &streaming->command_pool));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_COMMAND_POOL, streaming->command_pool);
+    DEBUG_NAME(VK_OBJECT_TYPE_COMMAND_POOL, streaming->command_pool, "Texture upload pool");
+
+    pthread_mutex_init(&streaming->lock, NULL);
+    pthread_cond_init(&streaming->wake, NULL);
+    if (pthread_create(&streaming->thread, NULL, texture_loader, streaming) != 0) {
+        puts("Failed to start texture loader, streaming disabled");
+        pthread_mutex_destroy(&streaming->lock);
+        pthread_cond_destroy(&streaming->wake);
+        return VK_SUCCESS;
+    }
+
+    streaming->running = true;
+    return VK_SUCCESS;
+}
+
+void stop_texture_streaming() {
+    struct texture_streaming* streaming = &ctx.streaming;
+    if (!streaming->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&streaming->lock);
+    streaming->stop = true;
+    pthread_cond_signal(&streaming->wake);
+    pthread_mutex_unlock(&streaming->lock);
+    pthread_join(streaming->thread, NULL);
+
+    pthread_mutex_destroy(&streaming->lock);
+    pthread_cond_destroy(&streaming->wake);
+    streaming->running = false;
+}
+
+void release_texture_jobs() {
+    for (uint32_t i = 0; i < MAX_TEXTURE_JOBS; i++) {
+        struct texture_job* job = &ctx.streaming.jobs[i];
+        if (job->state == TEXTURE_JOB_FREE) {
+            continue;
+        }
+
+        destroy_texture_job(job);
+        if (job->state == TEXTURE_JOB_UPLOADED) {
+            destroy_texture_image(&job->image);
+        }
+        job->state = TEXTURE_JOB_FREE;
+    }
+}
+
+void print_texture_stats() {
+    struct texture_streaming* streaming = &ctx.streaming;
+    uint32_t full = 0;
+    for (uint32_t i = 1; i < streaming->textures_count; i++) {
+        full += streaming->textures[i].state == TEXTURE_FULL;
+    }
+
+    printf("textures: %u of %u at full resolution, %.1f of %.1f MiB resident, %llu evictions\n",
+        full, streaming->textures_count - 1, streaming->resident / 1048576.0, streaming->budget / 1048576.0,
+        (unsigned long long)streaming->evictions);
+}
+
+uint32_t cull_instance_draws(struct instance_view view, struct gpu_instance* out, struct instance_draws* draws) {
+    struct instance_store* store = &ctx.instances;
+    if (store->order_dirty) {
+        instance_store_sort(store, ctx.draw_order);
+    }
+
+    uint32_t written = 0;
+    for (uint32_t t = 0; t < MAX_TEXTURES; t++) {
+        draws->first[t] = written;
+        draws->count[t] = ctx.kernels->cull(store, store->texture_first[t], store->texture_first[t + 1], view, out + written);
+        written += draws->count[t];
+    }
+
+    return written;
+}
+
+// Each slot owns a pair of timestamps around the main pass and, when the device
+// has pipeline statistics, a fragment shader invocation count.
+VkResult create_query_pools(uint32_t slots) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(ctx.physical_device, &properties);
+    uint32_t bits = ctx.queue_families.timestamp_bits;
+    ctx.timestamp_period = properties.limits.timestampPeriod;
+    ctx.timestamp_mask = bits >= 64 ? UINT64_MAX : (1ull << bits) - 1;
+    ctx.query_slots = slots;
+
+    if (bits > 0) {
+        VkQueryPoolCreateInfo timestamp_info = {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .queryType = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = slots * 2,
+        };
+
+        VkResult result = VK_CHECK(vkCreateQueryPool(ctx.logical_device, &timestamp_info, VK_ALLOCATOR, &ctx.timestamp_pool));
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+        TRACK(RESOURCE_QUERY_POOL, ctx.timestamp_pool);
+        DEBUG_NAME(VK_OBJECT_TYPE_QUERY_POOL, ctx.timestamp_pool, "Timestamp query pool");
+    }
+
+    if (ctx.statistics_supported) {
+        VkQueryPoolCreateInfo statistics_info = {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS,
+            .queryCount = slots,
+            .pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT,
+        };
+
+        VkResult result = VK_CHECK(vkCreateQueryPool(ctx.logical_device, &statistics_info, VK_ALLOCATOR, &ctx.statistics_pool));
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+        TRACK(RESOURCE_QUERY_POOL, ctx.statistics_pool);
+        DEBUG_NAME(VK_OBJECT_TYPE_QUERY_POOL, ctx.statistics_pool, "Pipeline statistics query pool");
+    }
+
+    return VK_SUCCESS;
+}
+
+// Both readers block until the slot's command buffer has finished on the GPU.
+bool read_gpu_time(uint32_t query, double* seconds) {
+    if (ctx.timestamp_pool == VK_NULL_HANDLE) {
+        return false;
+    }
+
+    uint64_t timestamps[2];
+    VkResult result = VK_CHECK(vkGetQueryPoolResults(ctx.logical_device, ctx.timestamp_pool, query * 2, 2, sizeof(timestamps),
+        timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+    if (result != VK_SUCCESS) {
+        return false;
+    }
+
+    uint64_t ticks = (timestamps[1] - timestamps[0]) & ctx.timestamp_mask;
+    *seconds = ticks * ctx.timestamp_period * 1e-9;
+    return true;
+}
+
+bool read_fragment_count(uint32_t query, uint64_t* fragments) {
+    if (ctx.statistics_pool == VK_NULL_HANDLE) {
+        return false;
+    }
+
+    VkResult result = VK_CHECK(vkGetQueryPoolResults(ctx.logical_device, ctx.statistics_pool, query, 1, sizeof(uint64_t),
+        fragments, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+    return result == VK_SUCCESS;
+}
+
+// Records one main pass per target into a single command buffer. Bindings are
+// made once and carry across the passes; only the viewport and the pushed view
+// scale change per target.
+VkResult record_command_buffer(VkCommandBuffer* buffer, const struct render_target* targets, uint32_t targets_count,
+        VkDescriptorSet descriptor_set, VkDeviceSize instance_offset, const struct instance_draws* draws,
+        const struct texture_uploads* uploads, uint32_t query) {
+    VkCommandBufferBeginInfo info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    };
+
+    VK_CHECK(vkBeginCommandBuffer(*buffer, &info));
+    if (uploads != NULL && uploads->count > 0) {
+        DEBUG_LABEL_BEGIN(*buffer, "Texture mips");
+        record_texture_uploads(*buffer, uploads);
+        DEBUG_LABEL_END(*buffer);
+    }
+
+    VkClearValue clear_values[2] = {
+        {.color = {{0.f, 0.f, 0.f, 0.1f}}},
+        {.depthStencil = {1.f, 0}},
+    };
+
+    bool timed = query != NO_QUERY && ctx.timestamp_pool != VK_NULL_HANDLE;
+    bool counted = query != NO_QUERY && ctx.statistics_pool != VK_NULL_HANDLE;
+    if (timed) {
+        vkCmdResetQueryPool(*buffer, ctx.timestamp_pool, query * 2, 2);
+        vkCmdWriteTimestamp(*buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, ctx.timestamp_pool, query * 2);
+    }
+    if (counted) {
+        vkCmdResetQueryPool(*buffer, ctx.statistics_pool, query, 1);
+        vkCmdBeginQuery(*buffer, ctx.statistics_pool, query, 0);
+    }
+
+    // Resolved once per frame so every output draws with the same variants.
+    VkPipeline pipelines[MAX_TEXTURES];
+    for (uint32_t texture = 0; texture < MAX_TEXTURES; texture++) {
+        if (draws->count[texture] > 0) {
+            struct pipeline_state state = draw_pipeline_state(texture);
+            pipelines[texture] = request_pipeline(&state);
+        }
+    }
+
+    VkPipeline bound = VK_NULL_HANDLE;
+    vkCmdBindVertexBuffers(*buffer, 0, 1, &ctx.instance_buffer, &instance_offset);
+    vkCmdBindDescriptorSets(*buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, ctx.pipeline_layout, 0, 1, &descriptor_set, 0, NULL);
+
+    for (uint32_t t = 0; t < targets_count; t++) {
+        const struct render_target* target = &targets[t];
+        VkRenderPassBeginInfo render_pass_info = {
+            .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+            .renderPass = ctx.render_pass,
+            .framebuffer = target->frame_buffer,
+            .renderArea.offset = {0, 0},
+            .renderArea.extent = target->extent,
+            .clearValueCount = 2,
+            .pClearValues = clear_values
+        };
+
+        DEBUG_LABEL_BEGIN(*buffer, "Main pass");
+        vkCmdBeginRenderPass(*buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+        {
+            DEBUG_LABEL_BEGIN(*buffer, "Triangles");
+            VkViewport viewport = {
+                .x = 0.f,
+                .y = 0.f,
+                .width = target->extent.width,
+                .height = target->extent.height,
+                .minDepth = 0.f,
+                .maxDepth = 1.f,
+            };
+            vkCmdSetViewport(*buffer, 0, 1, &viewport);
+
+            VkRect2D scissors = {
+                .offset = {0, 0},
+                .extent = target->extent,
+            };
+            vkCmdSetScissor(*buffer, 0, 1, &scissors);
+
+            vkCmdPushConstants(*buffer, ctx.pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(target->view), &target->view);
+            for (uint32_t texture = 0; texture < MAX_TEXTURES; texture++) {
+                if (draws->count[texture] == 0) {
+                    continue;
+                }
+
+                if (pipelines[texture] != bound) {
+                    bound = pipelines[texture];
+                    vkCmdBindPipeline(*buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, bound);
+                }
+
+                vkCmdPushConstants(*buffer, ctx.pipeline_layout, VK_SHADER_STAGE_FRAGMENT_BIT, sizeof(target->view), sizeof(uint32_t), &texture);
+                vkCmdDraw(*buffer, 3, draws->count[texture], 0, draws->first[texture]);
+            }
+            DEBUG_LABEL_END(*buffer);
+        }
+        vkCmdEndRenderPass(*buffer);
+        DEBUG_LABEL_END(*buffer);
+    }
+
+    if (counted) {
+        vkCmdEndQuery(*buffer, ctx.statistics_pool, query);
+    }
+    if (timed) {
+        vkCmdWriteTimestamp(*buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, ctx.timestamp_pool, query * 2 + 1);
+    }
+    return VK_CHECK(vkEndCommandBuffer(*buffer));
+}
+
+VkResult create_instance_buffer() {
+    VkBufferCreateInfo buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = sizeof(struct gpu_instance) * ctx.instances.capacity * MAX_FRAMES_IN_FLIGHT,
+        .usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+
+    VkResult result = VK_CHECK(vkCreateBuffer(ctx.logical_device, &buffer_info, VK_ALLOCATOR, &ctx.instance_buffer));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_BUFFER, ctx.instance_buffer);
+    DEBUG_NAME(VK_OBJECT_TYPE_BUFFER, ctx.instance_buffer, "Instance buffer");
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(ctx.logical_device, ctx.instance_buffer, &requirements);
+
+    VkMemoryAllocateInfo allocate_info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = requirements.size,
+    };
+
+    VkMemoryPropertyFlags host_visible = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    if (!find_memory_type(requirements.memoryTypeBits, host_visible | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &allocate_info.memoryTypeIndex) &&
+        !find_memory_type(requirements.memoryTypeBits, host_visible, &allocate_info.memoryTypeIndex)) {
+        return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    }
+
+    result = VK_CHECK(vkAllocateMemory(ctx.logical_device, &allocate_info, VK_ALLOCATOR, &ctx.instance_memory));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    TRACK(RESOURCE_DEVICE_MEMORY, ctx.instance_memory);
+
+    result = VK_CHECK(vkBindBufferMemory(ctx.logical_device, ctx.instance_buffer, ctx.instance_memory, 0));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    void* data = NULL;
+    result = VK_CHECK(vkMapMemory(ctx.logical_device, ctx.instance_memory, 0, VK_WHOLE_SIZE, 0, &data));
+    ctx.instance_data = data;
+    return result;
+}
+
+VkResult create_sync_objects() {
+    VkSemaphoreCreateInfo semaphore_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    };
+
+    VkFenceCreateInfo fence_info = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        .flags = VK_FENCE_CREATE_SIGNALED_BIT
+    };
+
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        struct frame* frame = &ctx.frames[i];
+        VkResult result = VK_CHECK(vkCreateFence(ctx.logical_device, &fence_info, VK_ALLOCATOR, &frame->in_flight_fence));
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+        TRACK(RESOURCE_FENCE, frame->in_flight_fence);
+        DEBUG_NAME(VK_OBJECT_TYPE_FENCE, frame->in_flight_fence, "In flight fence");
+
+        for (uint32_t o = 0; o < ctx.outputs_count && !ctx.headless; o++) {
+            VkSemaphore* semaphore = &ctx.outputs[o].image_available_semaphores[i];
+            result = VK_CHECK(vkCreateSemaphore(ctx.logical_device, &semaphore_info, VK_ALLOCATOR, semaphore));
+            if (result != VK_SUCCESS) {
+                return result;
+            }
+            TRACK(RESOURCE_SEMAPHORE, *semaphore);
+            DEBUG_NAME(VK_OBJECT_TYPE_SEMAPHORE, *semaphore, "Image available semaphore");
+        }
+    }
+
+    return VK_SUCCESS;
+}
+
+bool check_extension_support(VkPhysicalDevice* device) {
+    size_t count = sizeof(device_extensions) / sizeof(char*);
+
+    uint32_t extension_count = 0;
+    VK_CHECK(vkEnumerateDeviceExtensionProperties(*device, NULL, &extension_count, NULL));
+
+    size_t mark = arena_mark(&ctx.scratch);
+    VkExtensionProperties* available = arena_push(&ctx.scratch, extension_count * sizeof(VkExtensionProperties));
+    if (available == NULL) {
+        return false;
+    }
+    VK_CHECK(vkEnumerateDeviceExtensionProperties(*device, NULL, &extension_count, available));
+
+    uint32_t matches = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t n = 0; n < extension_count; n++) { 
+            if (strcmp(device_extensions[i], available[n].extensionName) == 0) {
+                matches++;
+                break;
+            }
+        }
+    }
+
+    arena_reset(&ctx.scratch, mark);
+
+    return matches == count;
+}
+
+bool device_suitable(VkPhysicalDevice* device) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(*device, &properties);
+    
+    VkPhysicalDeviceFeatures features;
+    vkGetPhysicalDeviceFeatures(*device, &features);
+    struct queue_family_indices indices = find_queue_families(device);
+    if (!indices.graphics_family.assigned) {
+        return false;
+    }
+
+    bool supports_extensions = ctx.headless || check_extension_support(device);
+    bool supports_swap_chain = ctx.headless;
+    if (supports_extensions && !ctx.headless) {
+        supports_swap_chain = true;
+        for (uint32_t i = 0; i < ctx.outputs_count && supports_swap_chain; i++) {
+            size_t mark = arena_mark(&ctx.scratch);
+            struct swap_chain_support_details details = query_swap_chain_details(device, ctx.outputs[i].surface, &ctx.scratch);
+            supports_swap_chain = details.formats_count != 0 && details.present_modes_count != 0;
+            arena_reset(&ctx.scratch, mark);
+        }
+    }
+
+    return properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU && features.geometryShader &&
+        features.shaderSampledImageArrayDynamicIndexing && supports_swap_chain;
+}
+
+VkResult init_device() {
+    uint32_t device_count = 0;
+    VK_CHECK(vkEnumeratePhysicalDevices(ctx.instance, &device_count, NULL));
+    if (device_count == 0) {
+        return !VK_SUCCESS;
+    }
+
+    size_t mark = arena_mark(&ctx.scratch);
+    VkPhysicalDevice* devices = arena_push(&ctx.scratch, sizeof(VkPhysicalDevice) * device_count);
+    if (devices == NULL) {
+        return VK_ERROR_OUT_OF_HOST_MEMORY;
+    }
+    VK_CHECK(vkEnumeratePhysicalDevices(ctx.instance, &device_count, devices));
+
+    ctx.physical_device = VK_NULL_HANDLE;
+    for (uint32_t i = 0; i < device_count; i++) {
+        VkPhysicalDevice device = devices[i];
+        if (!device_suitable(&device)) {
+            continue;
+        }
+
+        ctx.physical_device = device;
+        break;
+    }
+
+    arena_reset(&ctx.scratch, mark);
+
+    if (ctx.physical_device == VK_NULL_HANDLE) {
+        return !VK_SUCCESS;
+    }
+
+    ctx.queue_families = find_queue_families(&ctx.physical_device);
+    for (uint32_t i = 0; i < ctx.outputs_count && !ctx.headless; i++) {
+        struct output* output = &ctx.outputs[i];
+        output->surface_details = query_swap_chain_details(&ctx.physical_device, output->surface, &ctx.persistent);
+    }
+
+    return VK_SUCCESS;
+}
+
+
+VkResult create_instance() {
+    struct VkApplicationInfo application_info = {
+        .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+        .pApplicationName = "Meow",
+        .applicationVersion = VK_MAKE_VERSION(1, 0, 0),
+        .pEngineName = "Meowgine",
+        .engineVersion = VK_MAKE_VERSION(1, 0, 0),
+        .apiVersion = VK_API_VERSION_1_0
+    };
+
+    uint32_t extensions_count = 0;
+    const char** extensions = NULL;
+    if (!ctx.headless) {
+        extensions = glfwGetRequiredInstanceExtensions(&extensions_count);
+    }
+
+    struct VkInstanceCreateInfo create_info = {
+        .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+        .pApplicationInfo = &application_info,
+        .enabledExtensionCount = extensions_count,
+        .ppEnabledExtensionNames = extensions,
+        .enabledLayerCount = 0,
+    };
+
+#ifdef DEBUG
+    // Room for every extension GLFW needs plus debug utils and validation features.
+    size_t mark = arena_mark(&ctx.scratch);
+    const char** debug_extensions = arena_push(&ctx.scratch, sizeof(const char*) * (extensions_count + 2));
+    if (debug_extensions == NULL) {
+        return VK_ERROR_OUT_OF_HOST_MEMORY;
+    }
+
+    uint32_t debug_extensions_count = 0;
+    for (uint32_t i = 0; i < extensions_count; i++) {
+        debug_extensions[debug_extensions_count++] = extensions[i];
+    }
+
+    validation_enabled = check_layer_support(validation_layers[0]);
+    if (validation_enabled) {
+        create_info.enabledLayerCount = sizeof(validation_layers) / sizeof(char*);
+        create_info.ppEnabledLayerNames = validation_layers;
+    } else {
+        puts("Validation layer not available, continuing without it");
+    }
+
+    debug_utils_enabled = check_instance_extension_support(NULL, VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+    if (debug_utils_enabled) {
+        debug_extensions[debug_extensions_count++] = VK_EXT_DEBUG_UTILS_EXTENSION_NAME;
+    }
+
+    VkDebugUtilsMessengerCreateInfoEXT messenger_info = debug_messenger_create_info();
+    VkValidationFeatureEnableEXT enabled_features[] = {
+        VK_VALIDATION_FEATURE_ENABLE_BEST_PRACTICES_EXT,
+    };
+
+    VkValidationFeaturesEXT validation_features = {
+        .sType = VK_STRUCTURE_TYPE_VALIDATION_FEATURES_EXT,
+        .pNext = debug_utils_enabled ? &messenger_info : NULL,
+        .enabledValidationFeatureCount = sizeof(enabled_features) / sizeof(VkValidationFeatureEnableEXT),
+        .pEnabledValidationFeatures = enabled_features,
+    };
+
+    if (validation_enabled && check_instance_extension_support(validation_layers[0], VK_EXT_VALIDATION_FEATURES_EXTENSION_NAME)) {
+        debug_extensions[debug_extensions_count++] = VK_EXT_VALIDATION_FEATURES_EXTENSION_NAME;
+        create_info.pNext = &validation_features;
+    } else if (debug_utils_enabled) {
+        create_info.pNext = &messenger_info;
+    }
+
+    create_info.enabledExtensionCount = debug_extensions_count;
+    create_info.ppEnabledExtensionNames = debug_extensions;
+#endif
+
+    VkResult result = VK_CHECK(vkCreateInstance(&create_info, VK_ALLOCATOR, &ctx.instance));
+#ifdef DEBUG
+    arena_reset(&ctx.scratch, mark);
+#endif
+    return result;
+}
+
+VkResult create_surface(struct output* output) {
+    return VK_CHECK(glfwCreateWindowSurface(ctx.instance, output->window, VK_ALLOCATOR, &output->surface));
+}
+
+VkResult init_vulkan() {
+    if (!arena_init(&ctx.scratch, SCRATCH_ARENA_SIZE) || !arena_init(&ctx.persistent, PERSISTENT_ARENA_SIZE)) {
+        puts("Failed to allocate arenas");
+        return VK_ERROR_OUT_OF_HOST_MEMORY;
+    }
+
+    VkResult result;
+    result = create_instance();
+    if (result != VK_SUCCESS) {
+        puts("Failed to create instance");
+        return result;
+    }
+
+#ifdef DEBUG
+    result = create_debug_messenger();
+    if (result != VK_SUCCESS) {
+        puts("Failed to create debug messenger");
+        return result;
+    }
+#endif
+
+    for (uint32_t i = 0; i < ctx.outputs_count && !ctx.headless; i++) {
+        result = create_surface(&ctx.outputs[i]);
+        if (result != VK_SUCCESS) {
+            puts("Failed to create surface");
+            return result;
+        }
+    }
+
+    result = init_device();
+    if (result != VK_SUCCESS) {
+        puts("Failed to create device");
+        return result;
+    }
+
+    result = create_logical_device();
+    if (result != VK_SUCCESS) {
+        puts("Failed to create logical device");
+        return result;
+    }
+
+    result = create_pipeline_cache();
+    if (result != VK_SUCCESS) {
+        puts("Failed to create pipeline cache");
+        return result;
+    }
+
+    for (uint32_t i = 0; i < ctx.outputs_count; i++) {
+        struct output* output = &ctx.outputs[i];
+        if (ctx.headless) {
+            output->swap_chain.format = OFFSCREEN_FORMAT;
+            output->swap_chain.extent.width = WINDOW_WIDTH;
+            output->swap_chain.extent.height = WINDOW_HEIGHT;
+            if (ctx.replay.data != NULL) {
+                output->swap_chain.extent = ctx.replay.header->extents[i];
+            }
+        } else {
+            result = create_swap_chain(output, VK_NULL_HANDLE);
+            if (result != VK_SUCCESS) {
+                puts("Failed to create swap chain");
+                return result;
+            }
+
+            result = create_image_view(output);
+            if (result != VK_SUCCESS) {
+                puts("Failed to create image view");
+                return result;
+            }
+        }
+
+        if (ctx.color_format == VK_FORMAT_UNDEFINED) {
+            ctx.color_format = output->swap_chain.format;
+        } else if (output->swap_chain.format != ctx.color_format) {
+            puts("Outputs do not share a surface format");
+            return VK_ERROR_FORMAT_NOT_SUPPORTED;
+        }
+    }
+
+    ctx.depth_format = choose_depth_format();
+    if (ctx.depth_format == VK_FORMAT_UNDEFINED) {
+        puts("Failed to find a depth format");
+        return VK_ERROR_FORMAT_NOT_SUPPORTED;
+    }
+
+    VkSampleCountFlagBits requested_samples = ctx.samples;
+    ctx.samples = choose_sample_count(requested_samples);
+    ctx.pipeline_state.samples = ctx.samples;
+    if (ctx.samples != requested_samples) {
+        printf("%ux multisampling is not supported, using %ux\n", (uint32_t)requested_samples, (uint32_t)ctx.samples);
+    }
+
+    result = create_render_pass();
+    if (result != VK_SUCCESS) {
+        puts("Failed to create render pass");
+        return result;
+    }
+
+    result = create_descriptor_set_layout();
+    if (result != VK_SUCCESS) {
+        puts("Failed to create descriptor set layout");
+        return result;
+    }
+
+    result = create_graphics_pipeline();
+    if (result != VK_SUCCESS) {
+        puts("Failed to create graphics pipeline");
+        return result;
+    }
+
+    start_pipeline_workers();
+    request_default_pipelines();
+
+    for (uint32_t i = 0; i < ctx.outputs_count; i++) {
+        struct output* output = &ctx.outputs[i];
+        result = create_attachment_targets(output);
+        if (result != VK_SUCCESS) {
+            puts("Failed to create attachment targets");
+            return result;
+        }
+
+        if (ctx.headless) {
+            for (uint32_t t = 0; t < MAX_FRAMES_IN_FLIGHT && result == VK_SUCCESS; t++) {
+                result = create_offscreen_target(output, &output->targets[t]);
+            }
+        } else {
+            result = create_frame_buffer(output);
+        }
+
+        if (result != VK_SUCCESS) {
+            puts("Failed to create frame buffers");
+            return result;
+        }
+    }
+
+    result = create_command_pool();
+    if (result != VK_SUCCESS) {
+        puts("Failed to create command pool");
+        return result;
+    }
+
+    result = create_command_buffer();
+    if (result != VK_SUCCESS) {
+        puts("Failed to create command buffer");
+        return result;
+    }
+
+    result = create_sync_objects();
+    if (result != VK_SUCCESS) {
+        puts("Failed to create sync objects");
+        return result;
+    }
+
+    result = create_instance_buffer();
+    if (result != VK_SUCCESS) {
+        puts("Failed to create instance buffer");
+        return result;
+    }
+
+    result = create_texture_streaming();
+    if (result != VK_SUCCESS) {
+        puts("Failed to create texture streaming");
+        return result;
+    }
+
+    return VK_SUCCESS;
+}
+
+void retire_swap_chain(struct swap_chain* swap_chain) {
+    for (uint32_t i = 0; i < swap_chain->images_count; i++) {
+        if (swap_chain->frame_buffers != NULL) {
+            DEFER_DESTROY(RESOURCE_FRAMEBUFFER, swap_chain->frame_buffers[i]);
+        }
+
+        if (swap_chain->image_views != NULL) {
+            DEFER_DESTROY(RESOURCE_IMAGE_VIEW, swap_chain->image_views[i]);
+        }
+
+        if (swap_chain->render_finished_semaphores != NULL) {
+            DEFER_DESTROY(RESOURCE_SEMAPHORE, swap_chain->render_finished_semaphores[i]);
+        }
+    }
+
+    DEFER_DESTROY(RESOURCE_SWAP_CHAIN, swap_chain->handle);
+
+    host_free(swap_chain->images);
+    host_free(swap_chain->image_views);
+    host_free(swap_chain->frame_buffers);
+    host_free(swap_chain->render_finished_semaphores);
+    memset(swap_chain, 0, sizeof(struct swap_chain));
+}
+
+VkResult rebuild_pipeline() {
+    pause_pipeline_workers();
+
+    VkShaderModule vertex_shader = VK_NULL_HANDLE;
+    VkShaderModule fragment_shader = VK_NULL_HANDLE;
+    VkShaderModule old_vertex_shader = ctx.vertex_shader;
+    VkShaderModule old_fragment_shader = ctx.fragment_shader;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+
+    VkResult result = load_shader_modules(&vertex_shader, &fragment_shader);
+    if (result == VK_SUCCESS) {
+        ctx.vertex_shader = vertex_shader;
+        ctx.fragment_shader = fragment_shader;
+        struct pipeline_state state = generic_pipeline_state();
+        result = compile_pipeline(&state, &pipeline);
+    }
+
+    if (result != VK_SUCCESS) {
+        if (ctx.vertex_shader != old_vertex_shader) {
+            vkDestroyShaderModule(ctx.logical_device, vertex_shader, VK_ALLOCATOR);
+            vkDestroyShaderModule(ctx.logical_device, fragment_shader, VK_ALLOCATOR);
+        }
+        ctx.vertex_shader = old_vertex_shader;
+        ctx.fragment_shader = old_fragment_shader;
+        resume_pipeline_workers(false);
+        puts("Failed to rebuild graphics pipeline, keeping the previous one");
+        return result;
+    }
+
+    TRACK(RESOURCE_SHADER_MODULE, ctx.vertex_shader);
+    TRACK(RESOURCE_SHADER_MODULE, ctx.fragment_shader);
+    TRACK(RESOURCE_PIPELINE, pipeline);
+    DEBUG_NAME(VK_OBJECT_TYPE_PIPELINE, pipeline, "Triangle pipeline");
+    DEFER_DESTROY(RESOURCE_SHADER_MODULE, old_vertex_shader);
+    DEFER_DESTROY(RESOURCE_SHADER_MODULE, old_fragment_shader);
+    DEFER_DESTROY(RESOURCE_PIPELINE, ctx.pipeline);
+    ctx.pipeline = pipeline;
+
+    resume_pipeline_workers(true);
+    ctx.rebuilds++;
+    return VK_SUCCESS;
+}
+
+VkResult recreate_swap_chain(struct output* output) {
+    int width = 0;
+    int height = 0;
+    glfwGetFramebufferSize(output->window, &width, &height);
+    while ((width == 0 || height == 0) && !glfwWindowShouldClose(output->window)) {
+        glfwWaitEvents();
+        glfwGetFramebufferSize(output->window, &width, &height);
+    }
+
+    struct swap_chain old_swap_chain = output->swap_chain;
+    memset(&output->swap_chain, 0, sizeof(struct swap_chain));
+
+    VkResult result = create_swap_chain(output, old_swap_chain.handle);
+    retire_swap_chain(&old_swap_chain);
+    if (result != VK_SUCCESS) {
+        puts("Failed to recreate swap chain");
+        return result;
+    }
+
+    if (output->swap_chain.format != ctx.color_format) {
+        // Other outputs' frame buffers are bound to the shared render pass.
+        if (ctx.outputs_count > 1) {
+            puts("Output surface format changed, outputs must share one format");
+            return VK_ERROR_FORMAT_NOT_SUPPORTED;
+        }
+
+        ctx.color_format = output->swap_chain.format;
+        VkRenderPass old_render_pass = ctx.render_pass;
+        result = create_render_pass();
+        if (result != VK_SUCCESS) {
+            puts("Failed to recreate render pass");
+            return result;
+        }
+
+        DEFER_DESTROY(RESOURCE_RENDER_PASS, old_render_pass);
+        result = rebuild_pipeline();
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+    }
+
+    result = create_image_view(output);
+    if (result != VK_SUCCESS) {
+        puts("Failed to recreate image views");
+        return result;
+    }
+
+    retire_attachment_targets(output);
+    result = create_attachment_targets(output);
+    if (result != VK_SUCCESS) {
+        puts("Failed to recreate attachment targets");
+        return result;
+    }
+
+    result = create_frame_buffer(output);
+    if (result != VK_SUCCESS) {
+        puts("Failed to recreate frame buffers");
+        return result;
+    }
+
+    output->resized = false;
+    ctx.pacing.dirty = true;
+    ctx.rebuilds++;
+    return VK_SUCCESS;
+}
+
+// Headless outputs cycle through their offscreen targets, one per frame slot,
+// so the frame fence already guarantees the target is free.
+VkResult acquire_output_image(struct output* output) {
+    if (ctx.headless) {
+        output->image_index = ctx.current_frame;
+        return VK_SUCCESS;
+    }
+
+    return VK_CHECK(vkAcquireNextImageKHR(ctx.logical_device, output->swap_chain.handle, UINT64_MAX,
+        output->image_available_semaphores[ctx.current_frame], VK_NULL_HANDLE, &output->image_index));
+}
+
+struct render_target output_render_target(struct output* output) {
+    struct render_target target = {
+        .frame_buffer = ctx.headless ? output->targets[output->image_index].frame_buffer :
+            output->swap_chain.frame_buffers[output->image_index],
+        .extent = output->swap_chain.extent,
+        .view = instance_view_for_extent(output->swap_chain.extent),
+    };
+
+    return target;
+}
+
+// Moves the live instances and culls them once against the widest view of any
+// output; each pass then scales on the GPU.
+uint32_t simulate_frame(struct gpu_instance* out, struct instance_draws* draws, const struct render_target* targets,
+        uint32_t targets_count) {
+    double now = now_seconds();
+    float dt = ctx.last_update > 0.0 ? (float)(now - ctx.last_update) : 0.f;
+    ctx.last_update = now;
+    // Only a moving scene needs the next frame; a paused one waits for events
+    // like any other on-demand frame.
+    if (ctx.instances.count > 1 && !ctx.animation_paused) {
+        ctx.kernels->update(&ctx.instances, 0, ctx.instances.count, dt < 0.1f ? dt : 0.1f);
+        ctx.pacing.dirty = true;
+    }
+
+    // A smaller scale shows more of the world along that axis, so the union
+    // of every output's view keeps the per-axis minimum.
+    struct instance_view view = {FLT_MAX, FLT_MAX};
+    for (uint32_t i = 0; i < targets_count; i++) {
+        view.scale_x = targets[i].view.scale_x < view.scale_x ? targets[i].view.scale_x : view.scale_x;
+        view.scale_y = targets[i].view.scale_y < view.scale_y ? targets[i].view.scale_y : view.scale_y;
+    }
+
+    return cull_instance_draws(view, out, draws);
+}
+
+// Stands in for the update and cull: the captured instances, draws and view
+// constants go to the GPU unchanged.
+uint32_t replay_frame_commands(struct gpu_instance* out, struct instance_draws* draws, struct render_target* targets,
+        uint32_t targets_count) {
+    const struct capture_frame* frame = ctx.replay.frames[ctx.replay.current];
+    const struct capture_target* captured = (const struct capture_target*)(frame + 1);
+    const struct gpu_instance* instances = (const struct gpu_instance*)(captured + frame->targets_count);
+
+    for (uint32_t i = 0; i < targets_count && i < frame->targets_count; i++) {
+        targets[i].view = captured[i].view;
+    }
+
+    memcpy(out, instances, sizeof(struct gpu_instance) * frame->instances_count);
+    *draws = frame->draws;
+    return frame->instances_count;
+}
+
+bool capture_write(const void* data, size_t size) {
+    static const uint8_t padding[CAPTURE_ALIGNMENT] = {0};
+    size_t padded = align_up(size, CAPTURE_ALIGNMENT) - size;
+    return fwrite(data, 1, size, ctx.capture.file) == size && fwrite(padding, 1, padded, ctx.capture.file) == padded;
+}
+
+void stop_capture() {
+    if (ctx.capture.file == NULL) {
+        return;
+    }
+
+    if (fclose(ctx.capture.file) != 0) {
+        puts("Failed to finish capture");
+    } else if (ctx.print_stats) {
+        printf("capture: %llu frames\n", (unsigned long long)ctx.capture.frames);
+    }
+    ctx.capture.file = NULL;
+    host_free(ctx.capture.instances);
+    ctx.capture.instances = NULL;
+}
+
+// Written through stdio's buffer in a few calls, so capturing adds no heap
+// allocations to the frame.
+void capture_frame(const struct gpu_instance* instances, uint32_t count, const struct instance_draws* draws,
+        const struct render_target* targets, uint32_t targets_count, double cpu_seconds) {
+    struct capture_frame frame = {
+        .time = now_seconds() - ctx.capture.start,
+        .cpu_seconds = cpu_seconds,
+        .instances_count = count,
+        .targets_count = targets_count,
+        .draws = *draws,
+    };
+
+    struct capture_target captured[MAX_OUTPUTS];
+    for (uint32_t i = 0; i < targets_count; i++) {
+        captured[i].extent = targets[i].extent;
+        captured[i].view = targets[i].view;
+    }
+
+    size_t targets_size = sizeof(struct capture_target) * targets_count;
+    size_t instances_size = sizeof(struct gpu_instance) * count;
+    struct capture_record record = {
+        .type = CAPTURE_RECORD_FRAME,
+        .size = (uint32_t)(sizeof(frame) + targets_size + instances_size),
+    };
+
+    bool written = fwrite(&record, sizeof(record), 1, ctx.capture.file) == 1 &&
+        fwrite(&frame, sizeof(frame), 1, ctx.capture.file) == 1 &&
+        fwrite(captured, 1, targets_size, ctx.capture.file) == targets_size &&
+        capture_write(instances, instances_size);
+    if (!written) {
+        puts("Failed to write capture, stopping");
+        stop_capture();
+        return;
+    }
+
+    ctx.capture.frames++;
+}
+
+// Timestamps for a replayed frame are read back once its slot comes around again.
+void read_replay_timing(uint32_t slot) {
+    struct frame* frame = &ctx.frames[slot];
+    if (frame->replay_frame == 0) {
+        return;
+    }
+
+    double seconds = 0.0;
+    if (read_gpu_time(slot, &seconds)) {
+        ctx.replay.gpu_seconds[frame->replay_frame - 1] = seconds;
+    }
+    frame->replay_frame = 0;
+}
+
+// Every output is drawn from one cull, one command buffer and one submit, and
+// all swap chains go out in a single present.
+VkResult draw_frame() {
+    struct frame* frame = &ctx.frames[ctx.current_frame];
+    VK_CHECK(vkWaitForFences(ctx.logical_device, 1, &frame->in_flight_fence, VK_TRUE, UINT64_MAX));
+    if (frame->serial > ctx.completed_serial) {
+        ctx.completed_serial = frame->serial;
+    }
+    collect_garbage();
+    update_pipeline_variants();
+    read_replay_timing(ctx.current_frame);
+
+    struct output* active[MAX_OUTPUTS];
+    uint32_t active_count = 0;
+    for (uint32_t i = 0; i < ctx.outputs_count; i++) {
+        struct output* output = &ctx.outputs[i];
+        if (output->iconified) {
+            continue;
+        }
+
+        VkResult result = acquire_output_image(output);
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+            result = recreate_swap_chain(output);
+            if (result != VK_SUCCESS) {
+                return result;
+            }
+            continue;
+        }
+
+        if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+            return result;
+        }
+        active[active_count++] = output;
+    }
+
+    if (active_count == 0) {
+        return VK_SUCCESS;
+    }
+
+    double frame_start = now_seconds();
+    struct texture_uploads uploads;
+    update_texture_streaming(&uploads);
+
+    struct render_target targets[MAX_OUTPUTS];
+    for (uint32_t i = 0; i < active_count; i++) {
+        targets[i] = output_render_target(active[i]);
+    }
+
+    uint32_t instance_first = ctx.current_frame * ctx.instances.capacity;
+    struct gpu_instance* instances = ctx.capture.file != NULL ? ctx.capture.instances : ctx.instance_data + instance_first;
+    struct instance_draws draws;
+    uint32_t visible = ctx.replay.data != NULL ? replay_frame_commands(instances, &draws, targets, active_count) :
+        simulate_frame(instances, &draws, targets, active_count);
+    if (instances != ctx.instance_data + instance_first) {
+        memcpy(ctx.instance_data + instance_first, instances, sizeof(struct gpu_instance) * visible);
+    }
+    for (uint32_t i = 0; i < ctx.streaming.textures_count; i++) {
+        if (draws.count[i] > 0) {
+            ctx.streaming.textures[i].last_used = ctx.frame_serial + 1;
+        }
+    }
+
+    request_textures();
+    update_frame_descriptors(frame);
+
+    VkResult result = VK_CHECK(vkResetCommandBuffer(frame->command_buffer, 0));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    result = record_command_buffer(&frame->command_buffer, targets, active_count, frame->descriptor_set,
+        sizeof(struct gpu_instance) * instance_first, &draws, &uploads, ctx.replay.timing ? ctx.current_frame : NO_QUERY);
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    if (ctx.capture.file != NULL) {
+        capture_frame(instances, visible, &draws, targets, active_count, now_seconds() - frame_start);
+    }
+
+    VkSemaphore wait_semaphores[MAX_OUTPUTS + MAX_TEXTURE_JOBS];
+    VkPipelineStageFlags wait_stages[MAX_OUTPUTS + MAX_TEXTURE_JOBS];
+    VkSemaphore signal_semaphores[MAX_OUTPUTS];
+    VkSwapchainKHR swap_chains[MAX_OUTPUTS];
+    uint32_t image_indices[MAX_OUTPUTS];
+    uint32_t wait_count = 0;
+    uint32_t present_count = 0;
+    for (uint32_t i = 0; i < active_count && !ctx.headless; i++) {
+        struct output* output = active[i];
+        wait_semaphores[wait_count] = output->image_available_semaphores[ctx.current_frame];
+        wait_stages[wait_count++] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        signal_semaphores[present_count] = output->swap_chain.render_finished_semaphores[output->image_index];
+        swap_chains[present_count] = output->swap_chain.handle;
+        image_indices[present_count++] = output->image_index;
+    }
+
+    for (uint32_t i = 0; i < uploads.count; i++) {
+        wait_semaphores[wait_count] = uploads.jobs[i]->uploaded;
+        wait_stages[wait_count++] = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    }
+
+    VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .pWaitSemaphores = wait_semaphores,
+        .waitSemaphoreCount = wait_count,
+        .pWaitDstStageMask = wait_stages,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &frame->command_buffer,
+        .signalSemaphoreCount = present_count,
+        .pSignalSemaphores = signal_semaphores,
+    };
+
+    // The fence is only reset once the frame is certain to be submitted, so an
+    // early return never leaves the next wait on a fence nothing will signal.
+    result = VK_CHECK(vkResetFences(ctx.logical_device, 1, &frame->in_flight_fence));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    result = VK_CHECK(vkQueueSubmit(ctx.graphics_queue, 1, &submit_info, frame->in_flight_fence));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    frame->serial = ++ctx.frame_serial;
+    if (ctx.replay.timing) {
+        ctx.replay.cpu_seconds[ctx.replay.current] = now_seconds() - frame_start;
+        frame->replay_frame = ctx.replay.current + 1;
+    }
+
+    ctx.current_frame = (ctx.current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
+    if (present_count == 0) {
+        return VK_SUCCESS;
+    }
+
+    VkResult present_results[MAX_OUTPUTS];
+    VkPresentInfoKHR present_info = {
+        .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+        .waitSemaphoreCount = present_count,
+        .pWaitSemaphores = signal_semaphores,
+        .pSwapchains = swap_chains,
+        .swapchainCount = present_count,
+        .pImageIndices = image_indices,
+        .pResults = present_results,
+    };
+    result = VK_CHECK(vkQueuePresentKHR(ctx.present_queue, &present_info));
+    if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR && result != VK_ERROR_OUT_OF_DATE_KHR) {
+        return result;
+    }
+
+    for (uint32_t i = 0; i < active_count; i++) {
+        struct output* output = active[i];
+        if (present_results[i] == VK_ERROR_OUT_OF_DATE_KHR || present_results[i] == VK_SUBOPTIMAL_KHR || output->resized) {
+            result = recreate_swap_chain(output);
+            if (result != VK_SUCCESS) {
+                return result;
+            }
+        }
+    }
+
+    return VK_SUCCESS;
+}
+
+VkResult run_batch(uint32_t frames, uint32_t batch_size, uint32_t targets, VkCommandBuffer* buffers, VkFence* fences, double* seconds) {
+    VkResult result = VK_CHECK(vkResetFences(ctx.logical_device, BATCHES_IN_FLIGHT, fences));
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+
+    struct instance_view view = instance_view_for_extent(ctx.outputs[0].swap_chain.extent);
+    struct instance_draws draws;
+    cull_instance_draws(view, ctx.instance_data, &draws);
+    update_frame_descriptors(&ctx.frames[0]);
+
+    bool submitted[BATCHES_IN_FLIGHT] = {false};
+    double start = now_seconds();
+
+    uint32_t frame = 0;
+    for (uint32_t batch = 0; frame < frames; batch++) {
+        uint32_t slot = batch % BATCHES_IN_FLIGHT;
+        if (submitted[slot]) {
+            VK_CHECK(vkWaitForFences(ctx.logical_device, 1, &fences[slot], VK_TRUE, UINT64_MAX));
+            VK_CHECK(vkResetFences(ctx.logical_device, 1, &fences[slot]));
+        }
+
+        VkCommandBuffer* batch_buffers = &buffers[slot * batch_size];
+        uint32_t count = 0;
+        for (; count < batch_size && frame < frames; count++, frame++) {
+            struct render_target target = {ctx.offscreen_targets[frame % targets].frame_buffer, ctx.outputs[0].swap_chain.extent, view};
+            VK_CHECK(vkResetCommandBuffer(batch_buffers[count], 0));
+            result = record_command_buffer(&batch_buffers[count], &target, 1, ctx.frames[0].descriptor_set, 0, &draws, NULL, NO_QUERY);
+            if (result != VK_SUCCESS) {
+                return result;
+            }
+        }
+
+        VkSubmitInfo submit_info = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .commandBufferCount = count,
+            .pCommandBuffers = batch_buffers,
+        };
+
+        result = VK_CHECK(vkQueueSubmit(ctx.graphics_queue, 1, &submit_info, fences[slot]));
+        if (result != VK_SUCCESS) {
+            return result;
+        }
+        submitted[slot] = true;
+    }
+
+    for (uint32_t i = 0; i < BATCHES_IN_FLIGHT; i++) {
+        if (submitted[i]) {
+            VK_CHECK(vkWaitForFences(ctx.logical_device, 1, &fences[i], VK_TRUE, UINT64_MAX));
+        }
+    }
+
+    *seconds = now_seconds() - start;
+    return VK_SUCCESS;
+}
+
+VkResult batch_loop(struct batch_options* options) {
+    VkResult result = create_offscreen_targets(options->max_targets);
+    if (result != VK_SUCCESS) {
+        puts("Failed to create offscreen targets");
+        return result;
+    }
+
+    uint32_t buffers_count = options->max_batch_size * BATCHES_IN_FLIGHT;
+    VkCommandBuffer* buffers = host_alloc(sizeof(VkCommandBuffer) * buffers_count);
+    VkCommandBufferAllocateInfo buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = ctx.command_pool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = buffers_count,
+    };
+
+    result = VK_CHECK(vkAllocateCommandBuffers(ctx.logical_device, &buffer_info, buffers));
+    if (result != VK_SUCCESS) {
+        puts("Failed to allocate batch command buffers");
+        host_free(buffers);
+        return result;
+    }
+
+    VkFenceCreateInfo fence_info = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+    };
+
+    VkFence fences[BATCHES_IN_FLIGHT] = {VK_NULL_HANDLE};
+    for (uint32_t i = 0; i < BATCHES_IN_FLIGHT && result == VK_SUCCESS; i++) {
+        result = VK_CHECK(vkCreateFence(ctx.logical_device, &fence_info, VK_ALLOCATOR, &fences[i]));
+        TRACK(RESOURCE_FENCE, fences[i]);
+        DEBUG_NAME(VK_OBJECT_TYPE_FENCE, fences[i], "Batch fence");
+    }
+
+    for (uint32_t i = 0; i < buffers_count; i++) {
+        DEBUG_NAME(VK_OBJECT_TYPE_COMMAND_BUFFER, buffers[i], "Batch command buffer");
+    }
+
+    double seconds = 0.0;
+    if (result == VK_SUCCESS) {
+        result = run_batch(options->max_batch_size, options->max_batch_size, 1, buffers, fences, &seconds);
+    }
+
+    if (result == VK_SUCCESS) {
+        printf("%-8s %-8s %-8s %-10s %-12s %-10s\n", "batch", "targets", "frames", "submits", "seconds", "fps");
+    }
+
+    for (uint32_t batch_size = 1; batch_size <= options->max_batch_size && result == VK_SUCCESS; batch_size *= 2) {
+        for (uint32_t targets = 1; targets <= options->max_targets && result == VK_SUCCESS; targets *= 2) {
+            result = run_batch(options->frames, batch_size, targets, buffers, fences, &seconds);
+            if (result != VK_SUCCESS) {
+                break;
+            }
+
+            uint32_t submits = (options->frames + batch_size - 1) / batch_size;
+            printf("%-8u %-8u %-8u %-10u %-12.4f %-10.1f\n", batch_size, targets, options->frames, submits, seconds, options->frames / seconds);
+        }
+    }
+
+    if (result != VK_SUCCESS) {
+        puts("Batch rendering failed");
+    }
+
+    VK_CHECK(vkDeviceWaitIdle(ctx.logical_device));
+    for (uint32_t i = 0; i < BATCHES_IN_FLIGHT; i++) {
+        DEFER_DESTROY(RESOURCE_FENCE, fences[i]);
+    }
+
+    vkFreeCommandBuffers(ctx.logical_device, ctx.command_pool, buffers_count, buffers);
+    host_free(buffers);
+
+    retire_offscreen_targets();
+    collect_garbage();
+    return result;
+}
+
+// Spreads the seeded instances into a few large, heavily overlapping triangles
+// so fragment work dominates and draw order shows up in the numbers.
+void make_dense_scene(struct instance_store* store) {
+    for (uint32_t i = 0; i < store->count; i++) {
+        store->x[i] *= 0.4f;
+        store->y[i] *= 0.4f;
+        store->scale[i] *= 8.f;
+    }
+}
+
+static const char* const draw_order_names[DRAW_ORDER_COUNT] = {"unsorted", "front", "back"};
+
+VkResult overdraw_bench() {
+    VkResult result = create_offscreen_targets(1);
+    if (result == VK_SUCCESS) {
+        result = create_query_pools(1);
+    }
+    if (result != VK_SUCCESS) {
+        puts("Failed to create overdraw bench targets");
+        return result;
+    }
+
+    if (ctx.timestamp_pool == VK_NULL_HANDLE || !ctx.statistics_supported) {
+        puts("Note: missing timestamp or pipeline statistics queries, some columns read n/a");
+    }
+
+    make_dense_scene(&ctx.instances);
+    struct frame* frame = &ctx.frames[0];
+    update_frame_descriptors(frame);
+
+    struct instance_view view = instance_view_for_extent(ctx.outputs[0].swap_chain.extent);
+    struct render_target target = {ctx.offscreen_targets[0].frame_buffer, ctx.outputs[0].swap_chain.extent, view};
+    double pixels = (double)target.extent.width * target.extent.height;
+    double baseline_fragments = 0.0;
+    double baseline_seconds = 0.0;
+
+    printf("%-10s %-8s %-8s %-10s %-14s %-10s %-12s %-10s %-10s\n",
+        "order", "passes", "draws", "sort ms", "fragments", "overdraw", "gpu ms", "fragments", "gpu time");
+
+    // Unsorted goes first: later orders permute the store, and it should see seed order.
+    const enum draw_order orders[] = {DRAW_ORDER_UNSORTED, DRAW_ORDER_BACK_TO_FRONT, DRAW_ORDER_FRONT_TO_BACK};
+    for (uint32_t o = 0; o < sizeof(orders) / sizeof(orders[0]) && result == VK_SUCCESS; o++) {
+        double sort_start = now_seconds();
+        instance_store_sort(&ctx.instances, orders[o]);
+        double sort_seconds = now_seconds() - sort_start;
+
+        struct instance_draws draws;
+        cull_instance_draws(view, ctx.instance_data, &draws);
+
+        uint64_t fragments = 0;
+        double gpu_seconds = 0.0;
+        bool has_fragments = true;
+        bool has_time = true;
+        for (uint32_t i = 0; i < OVERDRAW_BENCH_FRAMES; i++) {
+            VK_CHECK(vkWaitForFences(ctx.logical_device, 1, &frame->in_flight_fence, VK_TRUE, UINT64_MAX));
+            VK_CHECK(vkResetFences(ctx.logical_device, 1, &frame->in_flight_fence));
+            VK_CHECK(vkResetCommandBuffer(frame->command_buffer, 0));
+            result = record_command_buffer(&frame->command_buffer, &target, 1, frame->descriptor_set, 0, &draws, NULL, 0);
+            if (result != VK_SUCCESS) {
+                break;
+            }
+
+            VkSubmitInfo submit_info = {
+                .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                .commandBufferCount = 1,
+                .pCommandBuffers = &frame->command_buffer,
+            };
+
+            result = VK_CHECK(vkQueueSubmit(ctx.graphics_queue, 1, &submit_info, frame->in_flight_fence));
+            if (result != VK_SUCCESS) {
+                break;
+            }
+
+            uint64_t frame_fragments = 0;
+            double frame_seconds = 0.0;
+            has_fragments = has_fragments && read_fragment_count(0, &frame_fragments);
+            has_time = has_time && read_gpu_time(0, &frame_seconds);
+            fragments += frame_fragments;
+            gpu_seconds += frame_seconds;
+        }
+
+        if (result != VK_SUCCESS) {
+            break;
+        }
+
+        double average_fragments = (double)fragments / OVERDRAW_BENCH_FRAMES;
+        double average_seconds = gpu_seconds / OVERDRAW_BENCH_FRAMES;
+        if (orders[o] == DRAW_ORDER_UNSORTED) {
+            baseline_fragments = average_fragments;
+            baseline_seconds = average_seconds;
+        }
+
+        char fragment_text[32] = "n/a";
+        char overdraw_text[32] = "n/a";
+        char fragment_saving[32] = "n/a";
+        char gpu_text[32] = "n/a";
+        char gpu_saving[32] = "n/a";
+        if (has_fragments) {
+            snprintf(fragment_text, sizeof(fragment_text), "%.0f", average_fragments);
+            snprintf(overdraw_text, sizeof(overdraw_text), "%.2fx", average_fragments / pixels);
+            if (baseline_fragments > 0.0) {
+                snprintf(fragment_saving, sizeof(fragment_saving), "%+.1f%%", 100.0 * (1.0 - average_fragments / baseline_fragments));
+            }
+        }
+        if (has_time) {
+            snprintf(gpu_text, sizeof(gpu_text), "%.3f", average_seconds * 1e3);
+            if (baseline_seconds > 0.0) {
+                snprintf(gpu_saving, sizeof(gpu_saving), "%+.1f%%", 100.0 * (1.0 - average_seconds / baseline_seconds));
+            }
+        }
+
+        printf("%-10s %-8u %-8u %-10.3f %-14s %-10s %-12s %-10s %-10s\n", draw_order_names[orders[o]],
+            ctx.instances.sort_passes, count_draw_groups(&ctx.instances), sort_seconds * 1e3,
+            fragment_text, overdraw_text, gpu_text, fragment_saving, gpu_saving);
+    }
+
+    if (result != VK_SUCCESS) {
+        puts("Overdraw bench failed");
+    }
+
+    VK_CHECK(vkDeviceWaitIdle(ctx.logical_device));
+    retire_offscreen_targets();
+    collect_garbage();
+    return result;
+}
+
+struct bench_job {
+    const struct instance_kernels* kernels;
+    struct instance_store* store;
+    struct gpu_instance* out;
+    struct instance_view view;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t iterations;
+    bool cull;
+    pthread_t thread;
+};
+
+void* bench_worker(void* data) {
+    struct bench_job* job = data;
+    for (uint32_t i = 0; i < job->iterations; i++) {
+        if (job->cull) {
+            job->kernels->cull(job->store, job->begin, job->end, job->view, job->out + job->begin);
+        } else {
+            job->kernels->update(job->store, job->begin, job->end, 1.f / 60.f);
+        }
+    }
+
+    return NULL;
+}
+
+double run_instance_bench(const struct instance_kernels* kernels, struct instance_store* store, struct gpu_instance* out,
+        bool cull, uint32_t threads, uint32_t iterations) {
+    struct bench_job jobs[BENCH_MAX_THREADS];
+    uint32_t chunk = (uint32_t)align_up((store->count + threads - 1) / threads, INSTANCE_LANES);
+    struct instance_view view = {1.f, 1.f};
+
+    double start = now_seconds();
+    uint32_t started = 0;
+    for (uint32_t t = 0; t < threads; t++) {
+        uint32_t begin = t * chunk < store->count ? t * chunk : store->count;
+        uint32_t end = begin + chunk < store->count ? begin + chunk : store->count;
+        jobs[t] = (struct bench_job){kernels, store, out, view, begin, end, iterations, cull, 0};
+        if (t == 0) {
+            continue;
+        }
+
+        if (pthread_create(&jobs[t].thread, NULL, bench_worker, &jobs[t]) != 0) {
+            break;
+        }
+        started = t;
+    }
+
+    bench_worker(&jobs[0]);
+    for (uint32_t t = 1; t <= started; t++) {
+        pthread_join(jobs[t].thread, NULL);
+    }
+
+    if (started + 1 != threads) {
+        return -1.0;
+    }
+
+    return now_seconds() - start;
+}
+
+uint32_t next_bench_step(uint32_t step, uint32_t max_step) {
+    if (step == max_step) {
+        return max_step + 1;
+    }
+
+    return step * 2 < max_step ? step * 2 : max_step;
+}
+
+int instance_bench(uint32_t count) {
+    struct instance_store store;
+    struct gpu_instance* out = tracked_alloc(sizeof(struct gpu_instance) * align_up(count, INSTANCE_LANES), INSTANCE_ALIGNMENT, ALLOCATION_SOURCE_APPLICATION);
+    if (!instance_store_init(&store, count) || out == NULL) {
+        puts("Failed to allocate instances");
+        instance_store_release(&store);
+        host_free(out);
+        return 1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t max_threads = cpus < 1 ? 1 : cpus > BENCH_MAX_THREADS ? BENCH_MAX_THREADS : (uint32_t)cpus;
+    uint32_t iterations = BENCH_INSTANCE_STEPS / count > 0 ? BENCH_INSTANCE_STEPS / count : 1;
+
+    printf("%-8s %-8s %-8s %-10s %-12s %-12s\n", "kernel", "op", "threads", "instances", "seconds", "Minst/s");
+    int status = 0;
+    for (uint32_t k = 0; k < INSTANCE_KERNEL_COUNT && status == 0; k++) {
+        const struct instance_kernels* kernels = &instance_kernel_table[k];
+        if (!instance_kernels_supported(kernels)) {
+            printf("%-8s skipped, not supported by this CPU\n", kernels->name);
+            continue;
+        }
+
+        for (uint32_t op = 0; op < 2 && status == 0; op++) {
+            for (uint32_t threads = 1; threads <= max_threads; threads = next_bench_step(threads, max_threads)) {
+                instance_store_seed(&store, 1);
+                double seconds = run_instance_bench(kernels, &store, out, op == 1, threads, iterations);
+                if (seconds < 0.0) {
+                    puts("Failed to start benchmark threads");
+                    status = 1;
+                    break;
+                }
+
+                printf("%-8s %-8s %-8u %-10u %-12.4f %-12.1f\n", kernels->name, op == 1 ? "cull" : "update", threads, count,
+                    seconds, (double)count * iterations / seconds * 1e-6);
+            }
+        }
+    }
+
+    instance_store_release(&store);
+    host_free(out);
+    return status;
+}
+
+// Draws the same frames into the first 1, 2, 4... headless outputs. The rest
+// keep their targets but sit out, so every run shares one device and pipeline.
+VkResult output_bench(uint32_t frames) {
+    uint32_t outputs = ctx.outputs_count;
+    double base_cpu = 0.0;
+    VkResult result = VK_SUCCESS;
+
+    printf("%-8s %-8s %-12s %-12s %-14s %-10s\n", "outputs", "frames", "wall ms", "cpu ms", "cpu ms/output", "cpu scale");
+    for (uint32_t count = 1; count <= outputs && result == VK_SUCCESS; count = next_bench_step(count, outputs)) {
+        ctx.outputs_count = count;
+        for (uint32_t i = 0; i < WARMUP_FRAMES && result == VK_SUCCESS; i++) {
+            result = draw_frame();
+        }
+
+        double wall_start = now_seconds();
+        double cpu_start = cpu_seconds();
+        for (uint32_t i = 0; i < frames && result == VK_SUCCESS; i++) {
+            result = draw_frame();
+        }
+        VK_CHECK(vkDeviceWaitIdle(ctx.logical_device));
+        double cpu = (cpu_seconds() - cpu_start) / frames;
+        double wall = (now_seconds() - wall_start) / frames;
+        if (result != VK_SUCCESS) {
+            break;
+        }
+
+        if (count == 1) {
+            base_cpu = cpu;
+        }
+        printf("%-8u %-8u %-12.4f %-12.4f %-14.4f %-10.2f\n", count, frames, wall * 1e3, cpu * 1e3, cpu * 1e3 / count,
+            base_cpu > 0.0 ? cpu / base_cpu : 0.0);
+    }
+
+    ctx.outputs_count = outputs;
+    if (result != VK_SUCCESS) {
+        puts("Output bench failed");
+    }
+
+    return result;
+}
+
+// Writes the header and every texture's pixels up front; frames are appended
+// by draw_frame as they are recorded.
+bool start_capture(const char* path) {
+    ctx.capture.file = fopen(path, "wb");
+    if (ctx.capture.file == NULL) {
+        printf("Failed to open %s\n", path);
+        return false;
+    }
+
+    struct capture_header header = {
+        .magic = CAPTURE_MAGIC,
+        .version = CAPTURE_VERSION,
+        .instance_size = sizeof(struct gpu_instance),
+        .outputs_count = ctx.outputs_count,
+        .textures_count = ctx.streaming.textures_count,
+        .samples = ctx.samples,
+        .cull_mode = ctx.pipeline_state.cull_mode,
+        .topology = ctx.pipeline_state.topology,
+        .blend = ctx.pipeline_state.blend,
+        .features = ctx.pipeline_state.features,
+    };
+
+    for (uint32_t i = 0; i < ctx.outputs_count; i++) {
+        header.extents[i] = ctx.outputs[i].swap_chain.extent;
+    }
+
+    // A texture that fails to decode is left out and replays as white, as it draws here.
+    bool written = capture_write(&header, sizeof(header));
+    for (uint32_t i = 1; i < ctx.streaming.textures_count && written; i++) {
+        struct capture_texture texture = {.texture = i};
+        uint8_t* pixels = decode_ppm(ctx.streaming.textures[i].path, &texture.width, &texture.height);
+        if (pixels == NULL) {
+            continue;
+        }
+
+        size_t size = (size_t)texture.width * texture.height * 4;
+        struct capture_record record = {
+            .type = CAPTURE_RECORD_TEXTURE,
+            .size = (uint32_t)(sizeof(texture) + size),
+        };
+
+        written = fwrite(&record, sizeof(record), 1, ctx.capture.file) == 1 &&
+            fwrite(&texture, sizeof(texture), 1, ctx.capture.file) == 1 &&
+            capture_write(pixels, size);
+        host_free(pixels);
+    }
+
+    if (!written) {
+        puts("Failed to write capture");
+        stop_capture();
+        return false;
+    }
+
+    // Frames are culled here first, then copied to the instance buffer: the
+    // file is written from host memory rather than read back from the mapping.
+    ctx.capture.instances = host_alloc(sizeof(struct gpu_instance) * ctx.instances.capacity);
+    if (ctx.capture.instances == NULL) {
+        puts("Failed to allocate capture instances");
+        stop_capture();
+        return false;
+    }
+
+    ctx.capture.start = now_seconds();
+    return true;
+}
+
+bool valid_capture_frame(const struct capture_frame* frame, uint32_t size, uint32_t textures_count) {
+    if (size < sizeof(struct capture_frame) || frame->targets_count > MAX_OUTPUTS) {
+        return false;
+    }
+
+    uint64_t expected = sizeof(struct capture_frame) + sizeof(struct capture_target) * (uint64_t)frame->targets_count +
+        sizeof(struct gpu_instance) * (uint64_t)frame->instances_count;
+    if (expected != size) {
+        return false;
+    }
+
+    // Slots past the captured textures hold nothing the capture declared.
+    for (uint32_t i = 0; i < MAX_TEXTURES; i++) {
+        if ((uint64_t)frame->draws.first[i] + frame->draws.count[i] > frame->instances_count ||
+            (i >= textures_count && frame->draws.count[i] > 0)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool valid_capture_texture(const struct capture_texture* texture, uint32_t size, uint32_t textures_count) {
+    return size >= sizeof(struct capture_texture) && texture->texture > 0 && texture->texture < textures_count &&
+        texture->width > 0 && texture->height > 0 && texture->width <= MAX_TEXTURE_SIZE && texture->height <= MAX_TEXTURE_SIZE &&
+        sizeof(struct capture_texture) + (uint64_t)texture->width * texture->height * 4 == size;
+}
+
+// The captured state goes straight into compile_pipeline, so only values the
+// command line can choose are accepted.
+bool valid_capture_pipeline_state(const struct capture_header* header) {
+    bool cull_mode = false;
+    for (uint32_t i = 0; i < sizeof(cull_modes) / sizeof(cull_modes[0]); i++) {
+        cull_mode = cull_mode || header->cull_mode == cull_modes[i];
+    }
+
+    bool topology = false;
+    for (uint32_t i = 0; i < sizeof(topologies) / sizeof(topologies[0]); i++) {
+        topology = topology || header->topology == (uint32_t)topologies[i];
+    }
+
+    return cull_mode && topology && header->blend < PIPELINE_BLEND_COUNT && (header->features & ~PIPELINE_FEATURES) == 0;
+}
+
+// Walks the mapped records twice: once to validate and count the frames, then
+// to index them. Nothing is copied; frames and pixels are read from the mapping.
+bool index_replay() {
+    struct replay* replay = &ctx.replay;
+    const struct capture_header* header = replay->header;
+    if (header->magic != CAPTURE_MAGIC || header->version != CAPTURE_VERSION ||
+        header->instance_size != sizeof(struct gpu_instance) || header->outputs_count == 0 ||
+        header->outputs_count > MAX_OUTPUTS || header->textures_count == 0 || header->textures_count > MAX_TEXTURES ||
+        header->samples == 0 || header->samples > 64 || (header->samples & (header->samples - 1)) != 0 ||
+        !valid_capture_pipeline_state(header)) {
+        return false;
+    }
+
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        size_t offset = sizeof(struct capture_header);
+        replay->frames_count = 0;
+        while (offset < replay->size) {
+            const struct capture_record* record = (const struct capture_record*)(replay->data + offset);
+            if (replay->size - offset < sizeof(struct capture_record) ||
+                replay->size - offset - sizeof(struct capture_record) < record->size) {
+                return false;
+            }
+
+            const uint8_t* payload = (const uint8_t*)(record + 1);
+            if (record->type == CAPTURE_RECORD_FRAME) {
+                const struct capture_frame* frame = (const struct capture_frame*)payload;
+                if (!valid_capture_frame(frame, record->size, header->textures_count)) {
+                    return false;
+                }
+
+                if (pass == 1) {
+                    replay->frames[replay->frames_count] = frame;
+                }
+                replay->frames_count++;
+                if (frame->instances_count > replay->max_instances) {
+                    replay->max_instances = frame->instances_count;
+                }
+            } else if (record->type == CAPTURE_RECORD_TEXTURE) {
+                const struct capture_texture* captured = (const struct capture_texture*)payload;
+                if (!valid_capture_texture(captured, record->size, header->textures_count)) {
+                    return false;
+                }
+
+                struct texture* texture = &ctx.streaming.textures[captured->texture];
+                texture->captured = payload + sizeof(struct capture_texture);
+                texture->captured_width = captured->width;
+                texture->captured_height = captured->height;
+            }
+
+            offset += sizeof(struct capture_record) + align_up(record->size, CAPTURE_ALIGNMENT);
+        }
+
+        if (pass == 0) {
+            if (replay->frames_count == 0) {
+                return false;
+            }
+
+            replay->frames = host_alloc(sizeof(struct capture_frame*) * replay->frames_count);
+            replay->cpu_seconds = host_alloc(sizeof(double) * replay->frames_count);
+            replay->gpu_seconds = host_alloc(sizeof(double) * replay->frames_count);
+            if (replay->frames == NULL || replay->cpu_seconds == NULL || replay->gpu_seconds == NULL) {
+                return false;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < replay->frames_count; i++) {
+        replay->cpu_seconds[i] = -1.0;
+        replay->gpu_seconds[i] = -1.0;
+    }
 
-    vkDestroyShaderModule(logical_device, vertex_shader, NULL);
-    vkDestroyShaderModule(logical_device, fragment_shader, NULL);
+    return true;
+}
 
-    free(vertex_shader_code);
-    free(fragment_shader_code);
+void release_replay() {
+    struct replay* replay = &ctx.replay;
+    if (replay->data != NULL) {
+        munmap((void*)replay->data, replay->size);
+    }
 
-    return result;
+    host_free(replay->frames);
+    host_free(replay->cpu_seconds);
+    host_free(replay->gpu_seconds);
+    memset(replay, 0, sizeof(struct replay));
 }
 
-VkResult create_frame_buffer() {
-    swap_chain_frame_buffers = malloc(sizeof(swap_chain_frame_buffers) * swap_chain_images_count);
+// Maps the capture and takes the outputs, pipeline state and textures from
+// it, so a replay matches the recording whatever else is on the command line.
+bool load_replay(const char* path) {
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) {
+        printf("Failed to open %s\n", path);
+        return false;
+    }
 
-    for (uint32_t i = 0; i < swap_chain_images_count; i++) {
-        VkImageView* image_view = &swap_chain_image_views[i];
+    struct stat info;
+    void* data = MAP_FAILED;
+    if (fstat(descriptor, &info) == 0 && info.st_size >= (off_t)sizeof(struct capture_header)) {
+        data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    }
+    close(descriptor);
 
-        VkFramebufferCreateInfo create_info = {
-            .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-            .renderPass = render_pass,
-            .attachmentCount = 1,
-            .pAttachments = image_view,
-            .width = swap_chain_extent.width,
-            .height = swap_chain_extent.height,
-            .layers = 1,
-        };
+    if (data == MAP_FAILED) {
+        printf("Failed to map %s\n", path);
+        return false;
+    }
 
-        VkResult result = vkCreateFramebuffer(logical_device, &create_info, NULL, &swap_chain_frame_buffers[i]);
-        if (result != VK_SUCCESS) {
-            return result;
-        }
+    struct replay* replay = &ctx.replay;
+    replay->data = data;
+    replay->size = (size_t)info.st_size;
+    replay->header = data;
+    posix_madvise(data, replay->size, POSIX_MADV_SEQUENTIAL);
+
+    if (!index_replay()) {
+        printf("%s is not a valid capture\n", path);
+        release_replay();
+        return false;
     }
 
-    return VK_SUCCESS;
+    const struct capture_header* header = replay->header;
+    ctx.outputs_count = header->outputs_count;
+    ctx.samples = (VkSampleCountFlagBits)header->samples;
+    ctx.pipeline_state.cull_mode = header->cull_mode;
+    ctx.pipeline_state.topology = (VkPrimitiveTopology)header->topology;
+    ctx.pipeline_state.blend = (enum pipeline_blend)header->blend;
+    ctx.pipeline_state.features = header->features;
+
+    // Every texture is kept at full resolution so none is evicted mid-run.
+    struct texture_streaming* streaming = &ctx.streaming;
+    streaming->textures_count = header->textures_count;
+    streaming->budget = (VkDeviceSize)-1 / 2;
+    for (uint32_t i = 1; i < streaming->textures_count; i++) {
+        struct texture* texture = &streaming->textures[i];
+        texture->path = "Captured texture";
+        texture->last_used = UINT64_MAX;
+        texture->state = texture->captured != NULL ? TEXTURE_EMPTY : TEXTURE_FAILED;
+    }
+
+    return true;
 }
 
-VkResult create_command_pool() {
-    struct queue_family_indices indices = find_queue_families(&physical_device);
-    VkCommandPoolCreateInfo create_info = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-        .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-        .queueFamilyIndex = indices.graphics_family.value,
-    };
+bool replay_textures_resident() {
+    struct texture_streaming* streaming = &ctx.streaming;
+    if (!streaming->running) {
+        return true;
+    }
 
-    return vkCreateCommandPool(logical_device, &create_info, NULL, &command_pool);
-}
+    for (uint32_t i = 1; i < streaming->textures_count; i++) {
+        if (streaming->textures[i].state != TEXTURE_FULL && streaming->textures[i].state != TEXTURE_FAILED) {
+            return false;
+        }
+    }
 
-VkResult create_command_buffer() {
-    VkCommandBufferAllocateInfo buffer_info = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .commandPool = command_pool,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = 1
-    };
+    return !texture_uploads_pending();
+}
 
-    return vkAllocateCommandBuffers(logical_device, &buffer_info, &command_buffer);
+int compare_seconds(const void* a, const void* b) {
+    double left = *(const double*)a;
+    double right = *(const double*)b;
+    return (left > right) - (left < right);
 }
 
-VkResult record_command_buffer(VkCommandBuffer* buffer, uint32_t image_index) {
-    VkCommandBufferBeginInfo info = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-    };
+// Negative entries are frames without a measurement and are left out.
+void print_timing_summary(const char* name, const double* seconds, uint32_t count, double* sorted) {
+    uint32_t measured = 0;
+    double sum = 0.0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (seconds[i] >= 0.0) {
+            sorted[measured++] = seconds[i];
+            sum += seconds[i];
+        }
+    }
 
-    vkBeginCommandBuffer(*buffer, &info);
+    if (measured == 0) {
+        printf("%-8s %-10s %-10s %-10s %-10s %-10s\n", name, "n/a", "n/a", "n/a", "n/a", "n/a");
+        return;
+    }
 
-    VkClearValue clear_color = {{{0.f, 0.f, 0.f, 0.1f}}};
-    VkRenderPassBeginInfo render_pass_info = {
-        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-        .renderPass = render_pass,
-        .framebuffer = swap_chain_frame_buffers[image_index],
-        .renderArea.offset = {0, 0},
-        .renderArea.extent = swap_chain_extent,
-        .clearValueCount = 1,
-        .pClearValues = &clear_color
-    };
+    qsort(sorted, measured, sizeof(double), compare_seconds);
+    printf("%-8s %-10.4f %-10.4f %-10.4f %-10.4f %-10.4f\n", name, sum / measured * 1e3, sorted[0] * 1e3,
+        sorted[measured / 2] * 1e3, sorted[(measured - 1) * 95 / 100] * 1e3, sorted[measured - 1] * 1e3);
+}
 
-    vkCmdBeginRenderPass(*buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
-    {
-        vkCmdBindPipeline(*buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-        VkViewport viewport = {
-            .x = 0.f,
-            .y = 0.f,
-            .width = swap_chain_extent.width,
-            .height = swap_chain_extent.height,
-        };
-        vkCmdSetViewport(*buffer, 0, 1, &viewport);
+void print_replay_report(uint32_t frames) {
+    struct replay* replay = &ctx.replay;
+    printf("%-8s %-10s %-10s %-14s %-14s\n", "frame", "cpu ms", "gpu ms", "captured cpu", "captured ms");
+    for (uint32_t i = 0; i < frames; i++) {
+        char gpu_text[32] = "n/a";
+        char interval_text[32] = "n/a";
+        if (replay->gpu_seconds[i] >= 0.0) {
+            snprintf(gpu_text, sizeof(gpu_text), "%.4f", replay->gpu_seconds[i] * 1e3);
+        }
+        if (i > 0) {
+            snprintf(interval_text, sizeof(interval_text), "%.4f", (replay->frames[i]->time - replay->frames[i - 1]->time) * 1e3);
+        }
 
-        VkRect2D scissors = {
-            .offset = {0, 0},
-            .extent = swap_chain_extent,
-        };
-        vkCmdSetScissor(*buffer, 0, 1, &scissors);
+        printf("%-8u %-10.4f %-10s %-14.4f %-14s\n", i, replay->cpu_seconds[i] * 1e3, gpu_text,
+            replay->frames[i]->cpu_seconds * 1e3, interval_text);
+    }
 
-        vkCmdDraw(*buffer, 3, 1, 0, 0);
+    double* sorted = host_alloc(sizeof(double) * frames);
+    if (sorted == NULL) {
+        return;
     }
-    vkCmdEndRenderPass(*buffer);
-    return vkEndCommandBuffer(*buffer);
+
+    printf("\n%-8s %-10s %-10s %-10s %-10s %-10s\n", "", "mean ms", "min ms", "median ms", "p95 ms", "max ms");
+    print_timing_summary("cpu", replay->cpu_seconds, frames, sorted);
+    print_timing_summary("gpu", replay->gpu_seconds, frames, sorted);
+    host_free(sorted);
 }
 
-VkResult create_sync_objects() {
-    VkSemaphoreCreateInfo semaphore_info = {
-        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-    };
+bool replay_should_close() {
+    return !ctx.headless && outputs_should_close();
+}
 
-    VkFenceCreateInfo fence_info = {
-        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-        .flags = VK_FENCE_CREATE_SIGNALED_BIT
-    };
+// The captured instances were culled for the captured extents, so drawing them
+// into an output of another size would time a different frame.
+bool replay_extents_match() {
+    const struct capture_frame* frame = ctx.replay.frames[ctx.replay.current];
+    const struct capture_target* captured = (const struct capture_target*)(frame + 1);
+    uint32_t target = 0;
+    for (uint32_t i = 0; i < ctx.outputs_count && target < frame->targets_count; i++) {
+        if (ctx.outputs[i].iconified) {
+            continue;
+        }
 
-    VkResult result;
-    result = vkCreateSemaphore(logical_device, &semaphore_info, NULL, &image_available_semaphore);
-    if (result != VK_SUCCESS) {
-        return result;
+        VkExtent2D extent = ctx.outputs[i].swap_chain.extent;
+        VkExtent2D expected = captured[target++].extent;
+        if (extent.width != expected.width || extent.height != expected.height) {
+            printf("Output %u is %ux%u but frame %u was captured at %ux%u\n", i, extent.width, extent.height,
+                ctx.replay.current, expected.width, expected.height);
+            return false;
+        }
     }
 
-    result = vkCreateSemaphore(logical_device, &semaphore_info, NULL, &render_finished_semaphore);
+    return true;
+}
+
+// Plays every captured frame once, as fast as the outputs allow. Textures
+// stream in and pipeline variants compile while the first frame is drawn
+// untimed, so the timed frames see no uploads or fallback pipelines.
+VkResult replay_loop() {
+    struct replay* replay = &ctx.replay;
+    VkResult result = create_query_pools(MAX_FRAMES_IN_FLIGHT);
     if (result != VK_SUCCESS) {
+        puts("Failed to create replay queries");
         return result;
     }
 
-    return vkCreateFence(logical_device, &fence_info, NULL, &in_flight_fence);
-}
+    if (ctx.timestamp_pool == VK_NULL_HANDLE) {
+        puts("Note: no timestamp queries, gpu columns read n/a");
+    }
 
-bool check_extension_support(VkPhysicalDevice* device) {
-    size_t count = sizeof(device_extensions) / sizeof(char*);
+    replay->current = 0;
+    double deadline = now_seconds() + REPLAY_WARMUP_SECONDS;
+    for (uint32_t settled = 0; settled < WARMUP_FRAMES && result == VK_SUCCESS && !replay_should_close();) {
+        if (!ctx.headless) {
+            glfwPollEvents();
+        }
 
-    uint32_t extension_count = 0;
-    vkEnumerateDeviceExtensionProperties(*device, NULL, &extension_count, NULL);
+        if (!replay_extents_match()) {
+            result = VK_ERROR_INITIALIZATION_FAILED;
+            break;
+        }
+        result = draw_frame();
+        settled = replay_textures_resident() || now_seconds() > deadline ? settled + 1 : 0;
+    }
+    wait_for_pipeline_variants();
+
+    uint32_t frames = 0;
+    replay->timing = true;
+    while (frames < replay->frames_count && result == VK_SUCCESS && !replay_should_close()) {
+        if (!ctx.headless) {
+            glfwPollEvents();
+        }
 
-    VkExtensionProperties* available = malloc(extension_count * sizeof(VkExtensionProperties));
-    vkEnumerateDeviceExtensionProperties(*device, NULL, &extension_count, available);
+        // Frames skipped while every window is minimised are not counted.
+        replay->current = frames;
+        if (!replay_extents_match()) {
+            result = VK_ERROR_INITIALIZATION_FAILED;
+            break;
+        }
 
-    uint32_t matches = 0;
-    for (uint32_t i = 0; i < count; i++) {
-        for (uint32_t n = 0; n < extension_count; n++) { 
-            if (strcmp(device_extensions[i], available[n].extensionName) == 0) {
-                matches++;
-                break;
-            }
+        uint64_t serial = ctx.frame_serial;
+        result = draw_frame();
+        if (ctx.frame_serial != serial) {
+            frames++;
+        } else if (!ctx.headless) {
+            glfwWaitEventsTimeout(IDLE_WAIT_SECONDS);
         }
     }
 
-    free(available);
-
-    return matches == count;
-}
+    VK_CHECK(vkDeviceWaitIdle(ctx.logical_device));
+    for (uint32_t slot = 0; slot < MAX_FRAMES_IN_FLIGHT; slot++) {
+        read_replay_timing(slot);
+    }
+    replay->timing = false;
 
-bool device_suitable(VkPhysicalDevice* device) {
-    VkPhysicalDeviceProperties properties;
-    vkGetPhysicalDeviceProperties(*device, &properties);
-    
-    VkPhysicalDeviceFeatures features;
-    vkGetPhysicalDeviceFeatures(*device, &features);
-    struct queue_family_indices indices = find_queue_families(device);
-    if (!indices.graphics_family.assigned) {
-        return false;
+    if (result != VK_SUCCESS) {
+        puts("Replay failed");
+        return result;
     }
 
-    bool supports_extensions = check_extension_support(device);
-    bool supports_swap_chain = false;
-    if (supports_extensions) {
-        struct swap_chain_support_details details = query_swap_chain_details(device);
-        supports_swap_chain = details.formats_count != 0 && details.present_modes_count != 0;
+    print_replay_report(frames);
+    return VK_SUCCESS;
+}
 
-        if (details.formats_count > 0) {
-            free(details.formats);
-        }
+void wait_until(double deadline) {
+    double sleep_until = deadline - PACING_SPIN_SECONDS;
+    if (sleep_until > now_seconds()) {
+        struct timespec time = {
+            .tv_sec = (time_t)sleep_until,
+            .tv_nsec = (long)((sleep_until - (time_t)sleep_until) * 1e9),
+        };
 
-        if (details.present_modes_count > 0) {
-            free(details.present_modes);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL) == EINTR) {
         }
     }
 
-    return properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU && features.geometryShader && supports_swap_chain;
-}
-
-VkResult init_device() {
-    uint32_t device_count = 0;
-    vkEnumeratePhysicalDevices(instance, &device_count, NULL);
-    if (device_count == 0) {
-        return !VK_SUCCESS;
+    while (now_seconds() < deadline) {
     }
+}
 
-    VkPhysicalDevice* devices = malloc(sizeof(VkPhysicalDevice) * device_count);
-    vkEnumeratePhysicalDevices(instance, &device_count, devices);
+void record_frame_time(struct frame_pacing* pacing, double now) {
+    if (pacing->last_frame > 0.0) {
+        double delta = now - pacing->last_frame;
+        if (pacing->frames == 0 || delta < pacing->min) {
+            pacing->min = delta;
+        }
 
-    physical_device = VK_NULL_HANDLE;
-    for (uint32_t i = 0; i < device_count; i++) {
-        VkPhysicalDevice device = devices[i];
-        if (!device_suitable(&device)) {
-            continue;
+        if (delta > pacing->max) {
+            pacing->max = delta;
         }
 
-        physical_device = device;
-        break;
+        pacing->frames++;
+        pacing->sum += delta;
+        pacing->sum_squares += delta * delta;
+        if (pacing->interval > 0.0) {
+            double error = delta - pacing->interval;
+            pacing->error_squares += error * error;
+            if (error > PACING_LATE_SECONDS) {
+                pacing->late_frames++;
+            }
+        }
     }
 
-    free(devices);
+    pacing->last_frame = now;
+}
 
-    if (physical_device == VK_NULL_HANDLE) {
-        return !VK_SUCCESS;
+void print_frame_pacing_stats(struct frame_pacing* pacing) {
+    if (pacing->frames == 0) {
+        puts("No consecutive frames to report frame times for");
+        return;
     }
 
-    return VK_SUCCESS;
+    double mean = pacing->sum / pacing->frames;
+    double variance = pacing->sum_squares / pacing->frames - mean * mean;
+    double deviation = variance > 0.0 ? sqrt(variance) : 0.0;
+
+    printf("frame times over %llu frames: mean %.3f ms, stddev %.3f ms, min %.3f ms, max %.3f ms\n",
+        (unsigned long long)pacing->frames, mean * 1e3, deviation * 1e3, pacing->min * 1e3, pacing->max * 1e3);
+    if (pacing->interval > 0.0) {
+        printf("target %.3f ms: rms error %.3f ms, %llu frames late by more than %.1f ms\n",
+            pacing->interval * 1e3, sqrt(pacing->error_squares / pacing->frames) * 1e3,
+            (unsigned long long)pacing->late_frames, PACING_LATE_SECONDS * 1e3);
+    }
 }
 
+void main_loop() {
+    uint64_t frames = 0;
+    struct frame_pacing* pacing = &ctx.pacing;
+    pacing->dirty = true;
+    while (!outputs_should_close()) {
+        if (pacing->iconified || (pacing->on_demand && !pacing->dirty)) {
+            glfwWaitEventsTimeout(IDLE_WAIT_SECONDS);
+            pacing->last_frame = 0.0;
+            update_pipeline_variants();
+            pacing->dirty = pacing->dirty || texture_uploads_pending();
+            continue;
+        }
 
-VkResult create_instance() {
-    struct VkApplicationInfo application_info = {
-        .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
-        .pApplicationName = "Meow",
-        .applicationVersion = VK_MAKE_VERSION(1, 0, 0),
-        .pEngineName = "Meowgine",
-        .engineVersion = VK_MAKE_VERSION(1, 0, 0),
-        .apiVersion = VK_API_VERSION_1_0
-    };
+        glfwPollEvents();
 
-    uint32_t extensions_count = 0;
-    const char** extensions = glfwGetRequiredInstanceExtensions(&extensions_count);
+        if (ctx.reload_pipeline) {
+            ctx.reload_pipeline = false;
+            rebuild_pipeline();
+        }
 
-    struct VkInstanceCreateInfo create_info = {
-        .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
-        .pApplicationInfo = &application_info,
-        .enabledExtensionCount = extensions_count,
-        .ppEnabledExtensionNames = extensions,
-        .enabledLayerCount = 0,
-    };
+        if (pacing->interval > 0.0) {
+            wait_until(pacing->next_deadline);
+        }
 
-    return vkCreateInstance(&create_info, NULL, &instance);
-}
+        double now = now_seconds();
+        record_frame_time(pacing, now);
+        pacing->next_deadline += pacing->interval;
+        if (pacing->next_deadline < now) {
+            pacing->next_deadline = now + pacing->interval;
+        }
+        pacing->dirty = false;
+
+        uint64_t rebuilds = ctx.rebuilds;
+        uint64_t busy_frames = ctx.streaming.busy_frames;
+        uint64_t variant_events = ctx.pipelines.fallback_binds + ctx.pipelines.compiled;
+        uint64_t allocations = main_thread_allocation_count();
+        if (draw_frame() != VK_SUCCESS) {
+            puts("Failed to draw frame");
+            break;
+        }
 
-VkResult create_surface() {
-    return glfwCreateWindowSurface(instance, window, NULL, &surface);
-}
+        // Rebuild frames are not counted at all. Frames that stream textures or
+        // promote pipeline variants track new handles as they go, so they are
+        // reported apart from the steady state.
+        frames++;
+        uint64_t frame_allocations = main_thread_allocation_count() - allocations;
+        if (frames <= WARMUP_FRAMES || ctx.rebuilds != rebuilds) {
+            continue;
+        }
 
-VkResult init_vulkan() {
-    VkResult result;
-    result = create_instance();
-    if (result != VK_SUCCESS) {
-        puts("Failed to create instance");
-        return result;
+        if (ctx.streaming.busy_frames != busy_frames) {
+            ctx.streaming_frames++;
+            ctx.streaming_allocations += frame_allocations;
+        } else if (ctx.pipelines.fallback_binds + ctx.pipelines.compiled != variant_events) {
+            ctx.fallback_frames++;
+            ctx.fallback_allocations += frame_allocations;
+        } else {
+            ctx.steady_state_frames++;
+            ctx.steady_state_allocations += frame_allocations;
+        }
     }
 
-    result = create_surface();
-    if (result != VK_SUCCESS) {
-        puts("Failed to create surface");
-        return result;
+#ifdef DEBUG
+    if (ctx.steady_state_allocations > 0) {
+        printf("Steady-state frames made %llu heap allocations over %llu frames\n",
+            (unsigned long long)ctx.steady_state_allocations, (unsigned long long)ctx.steady_state_frames);
     }
+#endif
 
-    result = init_device();
-    if (result != VK_SUCCESS) {
-        puts("Failed to create device");
-        return result;
+    if (ctx.print_stats || pacing->interval > 0.0 || pacing->on_demand) {
+        print_frame_pacing_stats(pacing);
     }
 
-    result = create_logical_device();
-    if (result != VK_SUCCESS) {
-        puts("Failed to create logical device");
-        return result;
+    if (ctx.print_stats && ctx.streaming.textures_count > 1) {
+        print_texture_stats();
     }
 
-    result = create_swap_chain();
-    if (result != VK_SUCCESS) {
-        puts("Failed to create swap chain");
-        return result;
+    if (ctx.print_stats) {
+        print_pipeline_stats();
     }
+}
 
-    result = create_image_view();
-    if (result != VK_SUCCESS) {
-        puts("Failed to create image view");
-        return result;
+void cleanup() {
+    stop_texture_streaming();
+    stop_pipeline_workers();
+    stop_capture();
+    if (ctx.logical_device != VK_NULL_HANDLE) {
+        VK_CHECK(vkDeviceWaitIdle(ctx.logical_device));
     }
 
-    result = create_render_pass();
-    if (result != VK_SUCCESS) {
-        puts("Failed to create render pass");
-        return result;
-    }
+    release_texture_jobs();
+    destroy_all_handles();
 
-    result = create_graphics_pipeline();
-    if (result != VK_SUCCESS) {
-        puts("Failed to create graphics pipeline");
-        return result;
+    for (uint32_t i = 0; i < ctx.outputs_count; i++) {
+        struct swap_chain* swap_chain = &ctx.outputs[i].swap_chain;
+        host_free(swap_chain->images);
+        host_free(swap_chain->image_views);
+        host_free(swap_chain->frame_buffers);
+        host_free(swap_chain->render_finished_semaphores);
     }
+    host_free(ctx.offscreen_targets);
+    instance_store_release(&ctx.instances);
+    release_replay();
 
-    result = create_frame_buffer();
-    if (result != VK_SUCCESS) {
-        puts("Failed to create frame buffers");
-        return result;
-    }
+    vkDestroyDevice(ctx.logical_device, VK_ALLOCATOR);
 
-    result = create_command_pool();
-    if (result != VK_SUCCESS) {
-        puts("Failed to create command pool");
-        return result;
+    for (uint32_t i = 0; i < ctx.outputs_count; i++) {
+        vkDestroySurfaceKHR(ctx.instance, ctx.outputs[i].surface, VK_ALLOCATOR);
     }
+#ifdef DEBUG
+    destroy_debug_messenger();
+#endif
+    vkDestroyInstance(ctx.instance, VK_ALLOCATOR);
 
-    result = create_command_buffer();
-    if (result != VK_SUCCESS) {
-        puts("Failed to create command buffer");
-        return result;
+    for (uint32_t i = 0; i < ctx.outputs_count; i++) {
+        glfwDestroyWindow(ctx.outputs[i].window);
     }
+    glfwTerminate();
 
-    result = create_sync_objects();
-    if (result != VK_SUCCESS) {
-        puts("Failed to create sync objects");
-        return result;
+    if (ctx.print_stats) {
+        print_allocation_stats();
     }
 
-    return VK_SUCCESS;
+    arena_release(&ctx.scratch);
+    arena_release(&ctx.persistent);
+    memset(&ctx, 0, sizeof(struct renderer_context));
 }
 
-void draw_frame() {
-    vkWaitForFences(logical_device, 1, &in_flight_fence, VK_TRUE, UINT64_MAX);
-    vkResetFences(logical_device, 1, &in_flight_fence);
-
-    uint32_t image_index;
-    vkAcquireNextImageKHR((logical_device), swap_chain, UINT64_MAX, image_available_semaphore, VK_NULL_HANDLE, &image_index);
-
-    vkResetCommandBuffer(command_buffer, 0);
-    record_command_buffer(&command_buffer, image_index);
-
-    VkPipelineStageFlags flags = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    VkSubmitInfo submit_info = {
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .pWaitSemaphores = &image_available_semaphore,
-        .waitSemaphoreCount = 1,
-        .pWaitDstStageMask = &flags,
-        .commandBufferCount = 1,
-        .pCommandBuffers = &command_buffer,
-        .signalSemaphoreCount = 1,
-        .pSignalSemaphores = &render_finished_semaphore,
-    };
+bool parse_uint(char* text, uint32_t* value) {
+    char* end = NULL;
+    unsigned long parsed = strtoul(text, &end, 10);
+    if (end == text || *end != '\0' || parsed == 0 || parsed > UINT32_MAX) {
+        return false;
+    }
 
-    vkQueueSubmit(graphics_queue, 1, &submit_info, in_flight_fence);
-    VkPresentInfoKHR present_info = {
-        .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-        .waitSemaphoreCount = 1,
-        .pWaitSemaphores = &render_finished_semaphore,
-        .pSwapchains = &swap_chain,
-        .swapchainCount = 1,
-        .pImageIndices = &image_index,
-    };
-    vkQueuePresentKHR(present_queue, &present_info);
+    *value = (uint32_t)parsed;
+    return true;
 }
 
-void main_loop() {
-    while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
-        draw_frame();
+bool parse_choice(char* text, const char* const* names, uint32_t count, uint32_t* choice) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (strcmp(text, names[i]) == 0) {
+            *choice = i;
+            return true;
+        }
     }
+
+    return false;
 }
 
-void cleanup() {
-    vkDestroySemaphore(logical_device, image_available_semaphore, NULL);
-    vkDestroySemaphore(logical_device, render_finished_semaphore, NULL);
+bool parse_draw_order(char* text, enum draw_order* order) {
+    uint32_t choice = 0;
+    if (!parse_choice(text, draw_order_names, DRAW_ORDER_COUNT, &choice)) {
+        return false;
+    }
 
-    vkDestroyCommandPool(logical_device, command_pool, NULL);
+    *order = (enum draw_order)choice;
+    return true;
+}
 
-    for (uint32_t i = 0; i < swap_chain_images_count; i++) {
-        vkDestroyFramebuffer(logical_device, swap_chain_frame_buffers[i], NULL);
+static const char* const cull_mode_names[3] = {"none", "back", "front"};
+static const char* const topology_names[2] = {"list", "strip"};
+static const char* const blend_names[PIPELINE_BLEND_COUNT] = {"none", "alpha", "additive"};
+
+bool parse_pipeline_option(char* option, char* text, struct pipeline_state* state) {
+    uint32_t choice = 0;
+    if (strcmp(option, "--cull") == 0 && parse_choice(text, cull_mode_names, 3, &choice)) {
+        state->cull_mode = cull_modes[choice];
+    } else if (strcmp(option, "--topology") == 0 && parse_choice(text, topology_names, 2, &choice)) {
+        state->topology = topologies[choice];
+    } else if (strcmp(option, "--blend") == 0 && parse_choice(text, blend_names, PIPELINE_BLEND_COUNT, &choice)) {
+        state->blend = (enum pipeline_blend)choice;
+    } else {
+        return false;
     }
 
-    vkDestroyPipeline(logical_device, pipeline, NULL);
-    vkDestroyPipelineLayout(logical_device, pipeline_layout, NULL);
-    vkDestroyRenderPass(logical_device, render_pass, NULL);
+    return true;
+}
 
-    for (uint32_t i = 0; i < swap_chain_images_count; i++) {
-        vkDestroyImageView(logical_device, swap_chain_image_views[i], NULL);
-    }
+void print_usage(char* program) {
+    printf("Usage: %s [--batch frames] [--batch-size n] [--targets n] [--fps n] [--on-demand] [--paused] [--instances n] [--bench-instances n]\n"
+        "       [--texture file.ppm]... [--texture-budget MiB] [--draw-order front|back|unsorted] [--overdraw-bench n]\n"
+        "       [--outputs n] [--headless frames] [--cull none|back|front] [--blend none|alpha|additive]\n"
+        "       [--topology list|strip] [--flat] [--msaa samples] [--capture file] [--replay file] [--offscreen]\n"
+        "       [--stats]\n", program);
+}
 
-    vkDestroySwapchainKHR(logical_device, swap_chain, NULL);
-    vkDestroyDevice(logical_device, NULL);
+int main(int argc, char** argv) {
+    ctx.main_thread = pthread_self();
+    struct batch_options batch = {
+        .frames = 0,
+        .max_batch_size = 16,
+        .max_targets = 4,
+    };
+    uint32_t fps = 0;
+    uint32_t instances = 1;
+    uint32_t bench_instances = 0;
+    uint32_t overdraw_instances = 0;
+    uint32_t headless_frames = 0;
+    ctx.outputs_count = 1;
+    uint32_t texture_budget = TEXTURE_BUDGET_MB;
+    ctx.streaming.textures_count = 1;
+    ctx.draw_order = DRAW_ORDER_FRONT_TO_BACK;
+    ctx.pipeline_state.cull_mode = VK_CULL_MODE_BACK_BIT;
+    ctx.pipeline_state.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    ctx.pipeline_state.blend = PIPELINE_BLEND_NONE;
+    ctx.pipeline_state.features = PIPELINE_FEATURE_TEXTURE | PIPELINE_FEATURE_VERTEX_COLOR;
+    ctx.samples = VK_SAMPLE_COUNT_1_BIT;
+    uint32_t samples = 1;
+    char* capture_path = NULL;
+    char* replay_path = NULL;
+    bool offscreen = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--batch") == 0 && has_value && parse_uint(argv[i + 1], &batch.frames)) {
+            i++;
+        } else if (strcmp(argv[i], "--batch-size") == 0 && has_value && parse_uint(argv[i + 1], &batch.max_batch_size)) {
+            i++;
+        } else if (strcmp(argv[i], "--targets") == 0 && has_value && parse_uint(argv[i + 1], &batch.max_targets)) {
+            i++;
+        } else if (strcmp(argv[i], "--fps") == 0 && has_value && parse_uint(argv[i + 1], &fps)) {
+            ctx.pacing.interval = 1.0 / fps;
+            i++;
+        } else if (strcmp(argv[i], "--instances") == 0 && has_value && parse_uint(argv[i + 1], &instances)) {
+            i++;
+        } else if (strcmp(argv[i], "--bench-instances") == 0 && has_value && parse_uint(argv[i + 1], &bench_instances)) {
+            i++;
+        } else if (strcmp(argv[i], "--texture") == 0 && has_value && ctx.streaming.textures_count < MAX_TEXTURES) {
+            ctx.streaming.textures[ctx.streaming.textures_count++].path = argv[++i];
+        } else if (strcmp(argv[i], "--texture-budget") == 0 && has_value && parse_uint(argv[i + 1], &texture_budget)) {
+            i++;
+        } else if (strcmp(argv[i], "--draw-order") == 0 && has_value && parse_draw_order(argv[i + 1], &ctx.draw_order)) {
+            i++;
+        } else if (strcmp(argv[i], "--overdraw-bench") == 0 && has_value && parse_uint(argv[i + 1], &overdraw_instances)) {
+            instances = overdraw_instances;
+            i++;
+        } else if (strcmp(argv[i], "--outputs") == 0 && has_value && parse_uint(argv[i + 1], &ctx.outputs_count) &&
+                ctx.outputs_count <= MAX_OUTPUTS) {
+            i++;
+        } else if (strcmp(argv[i], "--headless") == 0 && has_value && parse_uint(argv[i + 1], &headless_frames)) {
+            i++;
+        } else if (has_value && parse_pipeline_option(argv[i], argv[i + 1], &ctx.pipeline_state)) {
+            i++;
+        } else if (strcmp(argv[i], "--msaa") == 0 && has_value && parse_uint(argv[i + 1], &samples) &&
+                (samples & (samples - 1)) == 0 && samples <= 64) {
+            ctx.samples = (VkSampleCountFlagBits)samples;
+            i++;
+        } else if (strcmp(argv[i], "--capture") == 0 && has_value) {
+            capture_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && has_value) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--offscreen") == 0) {
+            offscreen = true;
+        } else if (strcmp(argv[i], "--flat") == 0) {
+            ctx.pipeline_state.features &= ~PIPELINE_FEATURE_VERTEX_COLOR;
+        } else if (strcmp(argv[i], "--on-demand") == 0) {
+            ctx.pacing.on_demand = true;
+        } else if (strcmp(argv[i], "--paused") == 0) {
+            ctx.animation_paused = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            ctx.print_stats = true;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
 
-    vkDestroySurfaceKHR(instance, surface, NULL);
-    vkDestroyInstance(instance, NULL);
+    if (bench_instances > 0) {
+        return instance_bench(bench_instances);
+    }
 
-    free(swap_chain_images);
-    free(swap_chain_image_views);
+    ctx.kernels = select_instance_kernels();
+    ctx.streaming.budget = (VkDeviceSize)texture_budget * 1024 * 1024;
+    if (replay_path != NULL) {
+        if (!load_replay(replay_path)) {
+            return 1;
+        }
+        instances = ctx.replay.max_instances > 0 ? ctx.replay.max_instances : 1;
+    }
 
-    glfwDestroyWindow(window);
-    glfwTerminate();
-}
+    if (!instance_store_init(&ctx.instances, instances)) {
+        puts("Failed to allocate instances");
+        return 1;
+    }
+    if (ctx.replay.data == NULL) {
+        instance_store_seed(&ctx.instances, 1);
+        if (ctx.streaming.textures_count > 1) {
+            instance_store_assign_textures(&ctx.instances, 1, ctx.streaming.textures_count - 1);
+        }
+    }
 
-int main() {
-    init_window();
+    ctx.headless = batch.frames > 0 || overdraw_instances > 0 || headless_frames > 0 || (replay_path != NULL && offscreen);
+    if (!ctx.headless) {
+        init_window();
+    }
 
     if (init_vulkan() != VK_SUCCESS) {
         return 1;
     }
 
-    main_loop();
+    if (capture_path != NULL && ctx.replay.data == NULL && !start_capture(capture_path)) {
+        cleanup();
+        return 1;
+    }
+
+    // Benchmarks measure the variants, not the generic pipeline standing in for them.
+    if (ctx.headless) {
+        wait_for_pipeline_variants();
+    }
+
+    int status = 0;
+    if (ctx.replay.data != NULL) {
+        status = replay_loop() == VK_SUCCESS ? 0 : 1;
+    } else if (overdraw_instances > 0) {
+        status = overdraw_bench() == VK_SUCCESS ? 0 : 1;
+    } else if (headless_frames > 0) {
+        status = output_bench(headless_frames) == VK_SUCCESS ? 0 : 1;
+    } else if (ctx.headless) {
+        status = batch_loop(&batch) == VK_SUCCESS ? 0 : 1;
+    } else {
+        main_loop();
+    }
     cleanup();
 
-    return 0;
+    return status;
 }
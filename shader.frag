@@ -1,8 +1,20 @@
 #version 450
 
+layout(set = 0, binding = 0) uniform sampler2D textures[16];
+
+layout(constant_id = 0) const bool textured = true;
+
+layout(push_constant) uniform push_constants {
+    layout(offset = 8) uint texture_index;
+} constants;
+
 layout(location = 0) in vec3 frag_color;
+layout(location = 1) in vec2 frag_uv;
 layout(location = 0) out vec4 out_color;
 
 void main() {
     out_color = vec4(frag_color, 1.0);
+    if (textured) {
+        out_color *= texture(textures[constants.texture_index], frag_uv);
+    }
 }
@@ -1,6 +1,17 @@
 #version 450
 
+layout(location = 0) in vec3 instance_position;
+layout(location = 1) in vec2 instance_size;
+layout(location = 2) in vec4 instance_color;
+
+layout(constant_id = 1) const bool vertex_colors = true;
+
+layout(push_constant) uniform push_constants {
+    vec2 view_scale;
+} constants;
+
 layout(location = 0) out vec3 frag_color;
+layout(location = 1) out vec2 frag_uv;
 
 vec2 positions[3] = vec2[] (
     vec2(0.0, -0.5),
@@ -15,6 +26,8 @@ vec3 colors[3] = vec3[] (
 );
 
 void main() {
-    gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-    frag_color = colors[gl_VertexIndex];
+    vec2 position = instance_position.xy + positions[gl_VertexIndex] * instance_size;
+    gl_Position = vec4(position * constants.view_scale, instance_position.z, 1.0);
+    frag_color = vertex_colors ? colors[gl_VertexIndex] * instance_color.rgb : instance_color.rgb;
+    frag_uv = positions[gl_VertexIndex] + 0.5;
 }
@@ -0,0 +1,316 @@
+// Checks for the parts of main.c that need no device or window. `make test`
+// builds this file, which includes main.c whole, and runs it.
+#define main vl_main
+#include "../main.c"
+#undef main
+
+static uint32_t checks = 0;
+static uint32_t failures = 0;
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+void check(bool passed, const char* text, const char* file, int line) {
+    checks++;
+    if (!passed) {
+        failures++;
+        printf("%s:%d: check failed: %s\n", file, line, text);
+    }
+}
+
+uint32_t next_random(uint32_t* state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+void test_draw_sort_key() {
+    CHECK(draw_sort_key(0, 5, 0.9f, DRAW_ORDER_FRONT_TO_BACK) < draw_sort_key(1, 0, 0.1f, DRAW_ORDER_FRONT_TO_BACK));
+    CHECK(draw_sort_key(1, 2, 0.9f, DRAW_ORDER_FRONT_TO_BACK) < draw_sort_key(1, 3, 0.1f, DRAW_ORDER_FRONT_TO_BACK));
+    CHECK(draw_sort_key(1, 2, 0.1f, DRAW_ORDER_FRONT_TO_BACK) < draw_sort_key(1, 2, 0.9f, DRAW_ORDER_FRONT_TO_BACK));
+    CHECK(draw_sort_key(1, 2, 0.9f, DRAW_ORDER_BACK_TO_FRONT) < draw_sort_key(1, 2, 0.1f, DRAW_ORDER_BACK_TO_FRONT));
+    CHECK(draw_sort_key(1, 2, 0.1f, DRAW_ORDER_UNSORTED) == draw_sort_key(1, 2, 0.9f, DRAW_ORDER_UNSORTED));
+}
+
+// Few distinct keys, so most of them tie and stability is actually exercised.
+void test_radix_sort() {
+    enum { COUNT = 4096 };
+    static uint64_t original[COUNT];
+    static uint64_t key_buffers[2][COUNT];
+    static uint32_t value_buffers[2][COUNT];
+    uint64_t* keys[2] = {key_buffers[0], key_buffers[1]};
+    uint32_t* values[2] = {value_buffers[0], value_buffers[1]};
+
+    uint32_t state = 1;
+    for (uint32_t i = 0; i < COUNT; i++) {
+        float depth = (next_random(&state) % 8) / 8.f;
+        uint32_t texture = next_random(&state) % 4;
+        original[i] = draw_sort_key(texture != 0, texture, depth, DRAW_ORDER_FRONT_TO_BACK);
+        keys[0][i] = original[i];
+        values[0][i] = i;
+    }
+
+    uint32_t passes = radix_sort(keys, values, COUNT);
+    CHECK(passes > 0);
+
+    bool ordered = true;
+    bool stable = true;
+    bool permutation = true;
+    for (uint32_t i = 0; i < COUNT; i++) {
+        permutation = permutation && keys[0][i] == original[values[0][i]];
+        if (i > 0) {
+            ordered = ordered && keys[0][i - 1] <= keys[0][i];
+            stable = stable && (keys[0][i - 1] != keys[0][i] || values[0][i - 1] < values[0][i]);
+        }
+    }
+    CHECK(ordered);
+    CHECK(stable);
+    CHECK(permutation);
+
+    for (uint32_t i = 0; i < COUNT; i++) {
+        keys[0][i] = 42;
+        values[0][i] = i;
+    }
+    CHECK(radix_sort(keys, values, COUNT) == 0);
+    CHECK(values[0][0] == 0 && values[0][COUNT - 1] == COUNT - 1);
+}
+
+void test_arena() {
+    struct arena arena;
+    CHECK(arena_init(&arena, 256));
+
+    uint8_t* first = arena_push(&arena, 3);
+    uint8_t* second = arena_push(&arena, 8);
+    CHECK(first == arena.base);
+    CHECK(second == arena.base + ARENA_ALIGNMENT);
+
+    size_t mark = arena_mark(&arena);
+    uint8_t* scratch = arena_push_zero(&arena, 64);
+    CHECK(scratch != NULL && scratch[0] == 0 && scratch[63] == 0);
+    arena_reset(&arena, mark);
+    CHECK(arena.offset == mark);
+    CHECK(arena.peak == (size_t)(scratch - arena.base) + 64);
+    CHECK(arena_push(&arena, 8) == scratch);
+
+    CHECK(arena_push(&arena, 1024) == NULL);
+    CHECK(arena.offset <= arena.capacity);
+
+    arena_release(&arena);
+    CHECK(arena.base == NULL && arena.capacity == 0);
+}
+
+void* allocate_off_main_thread(void* argument) {
+    (void)argument;
+    host_free(host_alloc(32));
+    return NULL;
+}
+
+void test_allocator() {
+    struct allocation_stats before = ctx.allocation_stats[ALLOCATION_SOURCE_APPLICATION];
+    uint64_t main_before = main_thread_allocation_count();
+
+    uint8_t* memory = host_alloc(100);
+    CHECK(memory != NULL);
+    struct allocation_stats* stats = &ctx.allocation_stats[ALLOCATION_SOURCE_APPLICATION];
+    CHECK(stats->current == before.current + 100);
+    CHECK(stats->allocations == before.allocations + 1);
+    CHECK(main_thread_allocation_count() == main_before + 1);
+
+    memset(memory, 0xab, 100);
+    memory = host_realloc(memory, 300);
+    CHECK(memory != NULL && memory[0] == 0xab && memory[99] == 0xab);
+    CHECK(stats->current == before.current + 300);
+
+    host_free(memory);
+    CHECK(stats->current == before.current);
+    CHECK(stats->frees == before.frees + 2);
+
+    void* aligned = tracked_alloc(16, 256, ALLOCATION_SOURCE_VULKAN);
+    CHECK(aligned != NULL && ((uintptr_t)aligned & 255) == 0);
+    tracked_free(aligned);
+    CHECK(ctx.allocation_stats[ALLOCATION_SOURCE_VULKAN].current == 0);
+
+    uint64_t main_after = main_thread_allocation_count();
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, allocate_off_main_thread, NULL) == 0);
+    pthread_join(thread, NULL);
+    CHECK(main_thread_allocation_count() == main_after);
+}
+
+void test_pipeline_hash() {
+    struct pipeline_state base = {VK_CULL_MODE_BACK_BIT, VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_SAMPLE_COUNT_1_BIT,
+        PIPELINE_BLEND_NONE, PIPELINE_FEATURES};
+    struct pipeline_state same = base;
+    CHECK(hash_pipeline_state(&base) == hash_pipeline_state(&same));
+    CHECK(pipeline_states_equal(&base, &same));
+
+    struct pipeline_state changed[5] = {base, base, base, base, base};
+    changed[0].cull_mode = VK_CULL_MODE_NONE;
+    changed[1].topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP;
+    changed[2].samples = VK_SAMPLE_COUNT_4_BIT;
+    changed[3].blend = PIPELINE_BLEND_ALPHA;
+    changed[4].features = PIPELINE_FEATURE_TEXTURE;
+    for (uint32_t i = 0; i < 5; i++) {
+        CHECK(hash_pipeline_state(&changed[i]) != hash_pipeline_state(&base));
+        CHECK(!pipeline_states_equal(&changed[i], &base));
+    }
+}
+
+// A capture with two textures, one 2x2 texture record and two frames of four
+// instances, laid out as capture_write would. Offsets of the parts the
+// corruption cases modify are returned through the pointers.
+size_t build_capture(uint8_t* buffer, size_t* frame_offset, size_t* texture_offset) {
+    struct capture_header header = {
+        .magic = CAPTURE_MAGIC,
+        .version = CAPTURE_VERSION,
+        .instance_size = sizeof(struct gpu_instance),
+        .outputs_count = 1,
+        .textures_count = 2,
+        .samples = 1,
+        .cull_mode = VK_CULL_MODE_BACK_BIT,
+        .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+        .blend = PIPELINE_BLEND_NONE,
+        .features = PIPELINE_FEATURES,
+        .extents = {{512, 512}},
+    };
+    size_t size = 0;
+    memcpy(buffer, &header, sizeof(header));
+    size += sizeof(header);
+
+    struct capture_texture texture = {.texture = 1, .width = 2, .height = 2};
+    struct capture_record record = {CAPTURE_RECORD_TEXTURE, sizeof(texture) + 2 * 2 * 4};
+    memcpy(buffer + size, &record, sizeof(record));
+    *texture_offset = size + sizeof(record);
+    memcpy(buffer + *texture_offset, &texture, sizeof(texture));
+    memset(buffer + *texture_offset + sizeof(texture), 0xff, 2 * 2 * 4);
+    size += sizeof(record) + align_up(record.size, CAPTURE_ALIGNMENT);
+
+    for (uint32_t f = 0; f < 2; f++) {
+        struct capture_frame frame = {.time = f * 0.016, .instances_count = 4, .targets_count = 1};
+        frame.draws.first[0] = 0;
+        frame.draws.count[0] = 1;
+        frame.draws.first[1] = 1;
+        frame.draws.count[1] = 3;
+        struct capture_target target = {{512, 512}, {1.f, 1.f}};
+        struct gpu_instance instances[4] = {{{0}, {0}, 0}};
+
+        record.type = CAPTURE_RECORD_FRAME;
+        record.size = sizeof(frame) + sizeof(target) + sizeof(instances);
+        memcpy(buffer + size, &record, sizeof(record));
+        *frame_offset = size + sizeof(record);
+        memcpy(buffer + *frame_offset, &frame, sizeof(frame));
+        memcpy(buffer + *frame_offset + sizeof(frame), &target, sizeof(target));
+        memcpy(buffer + *frame_offset + sizeof(frame) + sizeof(target), instances, sizeof(instances));
+        size += sizeof(record) + align_up(record.size, CAPTURE_ALIGNMENT);
+    }
+
+    return size;
+}
+
+bool replay_accepts(const uint8_t* data, size_t size) {
+    char path[] = "/tmp/vl_test_XXXXXX";
+    int descriptor = mkstemp(path);
+    if (descriptor < 0) {
+        return false;
+    }
+
+    bool written = write(descriptor, data, size) == (ssize_t)size;
+    close(descriptor);
+
+    // The rejection messages are expected here, so they go to /dev/null.
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+
+    memset(&ctx.streaming, 0, sizeof(ctx.streaming));
+    bool loaded = written && load_replay(path);
+    release_replay();
+    unlink(path);
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null);
+    return loaded;
+}
+
+void test_capture_parser() {
+    static uint8_t valid[4096];
+    static uint8_t corrupt[4096];
+    size_t frame_offset = 0;
+    size_t texture_offset = 0;
+    size_t size = build_capture(valid, &frame_offset, &texture_offset);
+
+    CHECK(replay_accepts(valid, size));
+
+    memset(&ctx.streaming, 0, sizeof(ctx.streaming));
+    char path[] = "/tmp/vl_test_XXXXXX";
+    int descriptor = mkstemp(path);
+    CHECK(descriptor >= 0 && write(descriptor, valid, size) == (ssize_t)size);
+    close(descriptor);
+    CHECK(load_replay(path));
+    CHECK(ctx.replay.frames_count == 2 && ctx.replay.max_instances == 4);
+    CHECK(ctx.streaming.textures[1].captured_width == 2 && ctx.streaming.textures[1].state == TEXTURE_EMPTY);
+    release_replay();
+    unlink(path);
+
+    // A file cut inside the header or inside the last frame record is rejected.
+    // A cut on a record boundary is a shorter but valid capture.
+    bool truncated_rejected = true;
+    for (size_t cut = 0; cut <= sizeof(struct capture_header); cut++) {
+        truncated_rejected = truncated_rejected && !replay_accepts(valid, cut);
+    }
+    for (size_t cut = frame_offset - sizeof(struct capture_record) + 1; cut < size; cut++) {
+        truncated_rejected = truncated_rejected && !replay_accepts(valid, cut);
+    }
+    CHECK(truncated_rejected);
+    CHECK(replay_accepts(valid, frame_offset - sizeof(struct capture_record)));
+
+    struct corruption {
+        size_t offset;
+        uint32_t value;
+    };
+    const struct corruption header_cases[] = {
+        {offsetof(struct capture_header, magic), 0},
+        {offsetof(struct capture_header, version), CAPTURE_VERSION + 1},
+        {offsetof(struct capture_header, instance_size), sizeof(struct gpu_instance) + 4},
+        {offsetof(struct capture_header, outputs_count), MAX_OUTPUTS + 1},
+        {offsetof(struct capture_header, textures_count), 0},
+        {offsetof(struct capture_header, textures_count), MAX_TEXTURES + 1},
+        {offsetof(struct capture_header, samples), 3},
+        {offsetof(struct capture_header, cull_mode), 7},
+        {offsetof(struct capture_header, topology), VK_PRIMITIVE_TOPOLOGY_POINT_LIST},
+        {offsetof(struct capture_header, blend), PIPELINE_BLEND_COUNT},
+        {offsetof(struct capture_header, features), 1u << 2},
+        {texture_offset + offsetof(struct capture_texture, texture), 2},
+        {texture_offset + offsetof(struct capture_texture, width), 3},
+        {frame_offset + offsetof(struct capture_frame, instances_count), 5},
+        {frame_offset + offsetof(struct capture_frame, targets_count), MAX_OUTPUTS + 1},
+        {frame_offset + offsetof(struct capture_frame, draws.count[1]), 4},
+        {frame_offset + offsetof(struct capture_frame, draws.count[2]), 1},
+        {frame_offset - sizeof(uint32_t), 1u << 30},
+    };
+
+    for (uint32_t i = 0; i < sizeof(header_cases) / sizeof(header_cases[0]); i++) {
+        memcpy(corrupt, valid, size);
+        memcpy(corrupt + header_cases[i].offset, &header_cases[i].value, sizeof(uint32_t));
+        bool rejected = !replay_accepts(corrupt, size);
+        if (!rejected) {
+            printf("corruption %u at offset %zu was accepted\n", i, header_cases[i].offset);
+        }
+        CHECK(rejected);
+    }
+}
+
+int main() {
+    ctx.main_thread = pthread_self();
+
+    test_draw_sort_key();
+    test_radix_sort();
+    test_arena();
+    test_allocator();
+    test_pipeline_hash();
+    test_capture_parser();
+
+    printf("%u checks, %u failed\n", checks, failures);
+    return failures == 0 ? 0 : 1;
+}